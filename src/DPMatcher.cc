@@ -6,134 +6,140 @@
 #include "ryggrad/src/base/Logger.h"
 #include "DPMatcher.h"
 #include <math.h>
+#include <limits.h>
 
-float DPMatcher::FindMatch(const Dmer& dm1, const Dmer& dm2,
-                           const RSiteReads& reads, float indelVariance, float cndfCoef, MatchInfo& mInfo,
-                           float& side1Score, float& side2Score) const { 
+DPMatcher::DPMatcher(float indelVariance, float cndfCoef, float minScore)
+                    : m_indelVariance(indelVariance), m_cndfCoef(cndfCoef), m_minScore(minScore), m_tolerances() {
+  // Below 2^24 the halved sum and the bounds are exact in float, so |cmt1-cmt2| <= 2*deviation is exactly the float test
+  m_tolerances.resize(s_tableSize);
+  for(int sum=0; sum<s_tableSize; sum++) {
+    float average = sum / 2.0;
+    m_tolerances[sum] = 2*Deviation(average);
+  }
+}
+
+int DPMatcher::Deviation(float average) const {
+  int deviation = sqrt(average*m_indelVariance)*m_cndfCoef;
+  return deviation;
+}
+
+bool DPMatcher::IsMatchFloat(int cmt1, int cmt2) const {
+  float average = (cmt1 + cmt2) / 2.0;
+  int deviation = Deviation(average);
+  return (cmt1>=average-deviation && cmt1<=average+deviation && cmt2>=average-deviation && cmt2<=average+deviation);
+}
+
+DPMatcher::Verdict DPMatcher::Validate(const Dmer& dm1, const RSiteRead& read1, const Dmer& dm2, const RSiteRead& read2, MatchInfo& mInfo) const {
+  int fwdLength1, fwdLength2, bwdLength1, bwdLength2;
+  MatchLengths(read1, read2, dm1.Pos(), dm2.Pos(), true, fwdLength1, fwdLength2);
+  MatchLengths(read1, read2, dm1.Pos(), dm2.Pos(), false, bwdLength1, bwdLength2);
+  // The lengths are the denominator of the score, so the matches needed are known up front. Each walk can add at most as many 
+  // matches as the sites left on its shorter side, and the dmer start is counted by both walks.
+  int minMatches = MinMatches(max(fwdLength1+bwdLength1, fwdLength2+bwdLength2)) + 1;
   MatchInfo mInfo1, mInfo2;
-  FindMatch(dm1.Seq(), dm2.Seq(), dm1.Pos(), dm2.Pos(), true, reads, indelVariance, cndfCoef, mInfo1);
-  FindMatch(dm1.Seq(), dm2.Seq(), dm1.Pos(), dm2.Pos(), false, reads, indelVariance, cndfCoef, mInfo2);
+  if(!FindMatch(read1, read2, dm1.Pos(), dm2.Pos(), true, fwdLength1, fwdLength2, minMatches-min(bwdLength1, bwdLength2), mInfo1)
+     || !FindMatch(read1, read2, dm1.Pos(), dm2.Pos(), false, bwdLength1, bwdLength2, minMatches-mInfo1.GetNumMatches(), mInfo2)) {
+    return RejectedEarly;
+  }
+  mInfo = CombineMatches(mInfo1, mInfo2);
+  FILE_LOG(logDEBUG4) << "Overall MatchInfo: " << mInfo.ToString();
+  return (mInfo.GetIdentScore() > m_minScore? Accepted: Rejected);
+}
+
+MatchInfo DPMatcher::CombineMatches(const MatchInfo& mInfo1, const MatchInfo& mInfo2) const {
   int totNumMatches = mInfo1.GetNumMatches() + mInfo2.GetNumMatches() - 1; //Subtracting 1 to cater for double-counting
   int seqLen1       = mInfo1.GetSeqLen1() + mInfo2.GetSeqLen1();
   int seqLen2       = mInfo1.GetSeqLen2() + mInfo2.GetSeqLen2();
-  mInfo = MatchInfo(totNumMatches, mInfo2.GetFirstMatchPos1(), mInfo1.GetLastMatchPos1(),
-                    mInfo2.GetFirstMatchPos2(), mInfo1.GetLastMatchPos2(), seqLen1, seqLen2);
-  side1Score = mInfo1.GetIdentScore();
-  side2Score = mInfo2.GetIdentScore();
-  FILE_LOG(logDEBUG4) << "Overall MatchInfo: " << mInfo.ToString();
-  return (mInfo.GetIdentScore());
+  return MatchInfo(totNumMatches, mInfo2.GetFirstMatchPos1(), mInfo1.GetLastMatchPos1(),
+                   mInfo2.GetFirstMatchPos2(), mInfo1.GetLastMatchPos2(), seqLen1, seqLen2);
 }
 
-//Cumulative DPMatcher
-float DPMatcher::FindMatch(int readIdx1, int readIdx2, int offset1, int offset2, bool matchDir,
-    const RSiteReads& reads, float indelVariance, float cndfCoef, MatchInfo& mInfo) const {
-
-  const RSiteRead& read1  = reads[readIdx1];
-  const RSiteRead& read2  = reads[readIdx2];
-  
-  int baseLength1 = LengthOfBases(readIdx1, offset1, matchDir, reads);
-  int baseLength2 = LengthOfBases(readIdx2, offset2, matchDir, reads);
-  int length1 = read1.Size() - offset1; 
-  int length2 = read2.Size() - offset2; 
-  if(!matchDir) { //moving backwards to find match
-    length1 = offset1 + 1; 
-    length2 = offset2 + 1; 
+int DPMatcher::MinMatches(int seqLen) const {
+  if(!(m_minScore >= 0) || seqLen <= 0) { return INT_MIN/2; } // Every match count may be accepted
+  // Start just below the exact bound and step up through the float rounding of the score
+  int numMatches = max(-1, (int)min((double)m_minScore*seqLen, (double)seqLen) - 1);
+  while(numMatches <= seqLen && !(MatchInfo(numMatches, 0, 0, 0, 0, seqLen, seqLen).GetIdentScore() > m_minScore)) {
+    numMatches++;
   }
+  return numMatches;
+}
+
+void DPMatcher::MatchLengths(const RSiteRead& read1, const RSiteRead& read2, int offset1, int offset2, bool matchDir, 
+                             int& length1, int& length2) const {
+  SiteWalk walk1 = read1.Walk(offset1, matchDir);
+  SiteWalk walk2 = read2.Walk(offset2, matchDir);
+  length1 = (matchDir? read1.Size() - offset1: offset1 + 1);
+  length2 = (matchDir? read2.Size() - offset2: offset2 + 1);
+  int baseLength1 = walk1.Sum(0, length1);
+  int baseLength2 = walk2.Sum(0, length2);
   if(baseLength1 <= baseLength2) { // Change length2
-    length2 = GetRSiteLenForBaseLength(readIdx2, offset2, matchDir, baseLength1, reads);
+    length2 = GetRSiteLenForBaseLength(walk2, length2, baseLength1);
   } else { // change length1
-    length1 = GetRSiteLenForBaseLength(readIdx1, offset1, matchDir, baseLength2, reads);
+    length1 = GetRSiteLenForBaseLength(walk1, length1, baseLength2);
   }
+}
+
+//Cumulative DPMatcher
+bool DPMatcher::FindMatch(const RSiteRead& read1, const RSiteRead& read2, int offset1, int offset2, bool matchDir, int length1, int length2,
+                          int minMatches, MatchInfo& mInfo) const {
+  // Both directions walk the prefix sums of the forward strands (see SiteWalk), so they share this one integer loop
+  SiteWalk walk1 = read1.Walk(offset1, matchDir);
+  SiteWalk walk2 = read2.Walk(offset2, matchDir);
+  if(min(length1, length2) < minMatches) { return false; }
 
   int maxCell_score  = 0;
-  int maxCell_coord1 = offset1;
-  int maxCell_coord2 = offset2;
+  int maxCell_coord1 = 0;
+  int maxCell_coord2 = 0;
 
+  // The read value cumulations are differences of prefix sums: the one after the current site less the one the cumulation started at
+  int stride1 = walk1.Stride(), stride2 = walk2.Stride();
+  const int* next1 = walk1.At(1);
+  const int* next2 = walk2.At(1);
+  int cmtStart1 = *walk1.At(0), cmtStart2 = *walk2.At(0);
   int coord1=0, coord2=0;
-  bool coord1Changed=true, coord2Changed=true;
-  int readCmt1=0, readCmt2=0; //Read value cumulations
   while(coord1 < length1 && coord2 < length2) {
-    int readVal1 = read1[offset1+coord1];
-    int readVal2 = read2[offset2+coord2];
-    if(!matchDir) {
-      readVal1 = read1[offset1-coord1];
-      readVal2 = read2[offset2-coord2];
-    }
-    if(coord1Changed) { readCmt1 += readVal1; }
-    if(coord2Changed) { readCmt2 += readVal2; }
-    float average = (readCmt1 + readCmt2) / 2.0;
-    int deviation = sqrt(average*indelVariance)*cndfCoef;
-    FILE_LOG(logDEBUG4) << "Using deviation value:" << deviation << " for sites: " << readCmt1 << " " << readCmt2; 
-    int matched = (readCmt1>=average-deviation && readCmt1<=average+deviation 
-                    && readCmt2>=average-deviation && readCmt2<=average+deviation)? 1 : 0;
-    if(matched) { 
-      FILE_LOG(logDEBUG4) << "Matched " << coord1 << " " << coord2; 
+    int readCmt1 = stride1*(*next1 - cmtStart1);
+    int readCmt2 = stride2*(*next2 - cmtStart2);
+    if(IsMatch(readCmt1, readCmt2)) { 
       maxCell_score++;
-      if(matchDir) {
-        maxCell_coord1 = offset1 + coord1; 
-        maxCell_coord2 = offset2 + coord2;
-      } else {
-        maxCell_coord1 = offset1 - coord1; 
-        maxCell_coord2 = offset2 - coord2;
-      }
+      maxCell_coord1 = coord1; 
+      maxCell_coord2 = coord2;
       coord1++;
       coord2++;
-      readCmt1 = 0;
-      readCmt2 = 0;
-      coord1Changed = true;
-      coord2Changed = true;
+      cmtStart1 = *next1;
+      cmtStart2 = *next2;
+      next1 += stride1;
+      next2 += stride2;
       continue;
     }
     if(readCmt1 > readCmt2) {
       coord2++; //move other coordinate up only
-      coord1Changed = false;
-      coord2Changed = true;
+      next2 += stride2;
     } else {
       coord1++; //move other coordinate up only
-      coord1Changed = true;
-      coord2Changed = false;
+      next1 += stride1;
     }
+    // Every further match takes up at least one site on either side
+    if(maxCell_score + min(length1-coord1, length2-coord2) < minMatches) { return false; }
   }
   if(matchDir) {
-    mInfo = MatchInfo(maxCell_score, offset1, maxCell_coord1, offset2, maxCell_coord2, length1, length2);
+    mInfo = MatchInfo(maxCell_score, offset1, offset1+maxCell_coord1, offset2, offset2+maxCell_coord2, length1, length2);
   } else {
-    mInfo = MatchInfo(maxCell_score, maxCell_coord1, offset1, maxCell_coord2, offset2, length1, length2);
+    mInfo = MatchInfo(maxCell_score, offset1-maxCell_coord1, offset1, offset2-maxCell_coord2, offset2, length1, length2);
   }
   FILE_LOG(logDEBUG4) << "MatchInfo: " << mInfo.ToString();
-
-  return mInfo.GetIdentScore();
+  return (maxCell_score >= minMatches);
 }
 
-int DPMatcher::LengthOfBases(int readIdx, int offset, bool dir, const RSiteReads& reads) const {
-  const RSiteRead& read  = reads[readIdx];
-  int totBaseLen         = 0;
-  int siteLen            = read.Size() - offset; 
-  if(!dir) { //moving backwards 
-    siteLen = offset + 1; 
-  }
-  for(int idx=0; idx<siteLen; idx++) {
-    int toAdd = read[offset + idx];
-    if(!dir) { toAdd = read[offset - idx]; }
-    totBaseLen += toAdd;
-  }
-  return totBaseLen;
-}
-
-int DPMatcher::GetRSiteLenForBaseLength(int readIdx, int offset, bool dir, int totLength, const RSiteReads& reads) const {
-  const RSiteRead& read  = reads[readIdx];
-  int totBaseLen         = 0;
-  int siteLen            = read.Size() - offset; 
-  if(!dir) { //moving backwards 
-    siteLen = offset + 1; 
-  }
-  for(int idx=0; idx<siteLen; idx++) {
-    int toAdd = read[offset + idx];
-    if(!dir) { toAdd = read[offset - idx]; }
-    totBaseLen += toAdd;
-    if(totBaseLen >= totLength) {
-      return idx;
-    }
+int DPMatcher::GetRSiteLenForBaseLength(const SiteWalk& walk, int siteLen, int totLength) const {
+  // The walk's sums never decrease, so the first site reaching totLength is found by binary search
+  int lo = 1, hi = siteLen+1;  // Smallest number of sites in [lo, hi) covering totLength
+  while(lo < hi) {
+    int mid = lo + (hi-lo)/2;
+    if(walk.Sum(0, mid) >= totLength) { hi = mid;   }
+    else                              { lo = mid+1; }
   }
+  return (lo <= siteLen? lo-1: siteLen); // Index of that site, or every site if the region is shorter than totLength
 }
  
 float MatchInfo::GetOverlapScore() const { 
@@ -44,18 +44,58 @@ private:
   int m_seqLen2;         /// Length of region to be matched from the second sequence
 };
 
+/* Number of candidate matches validated, how many of them were given up before walking to the end and how many were 
+ * not validated again as their pair had been rejected on the same diagonal (see ValidationMemo), kept per thread */
+struct ValidationStats
+{
+  ValidationStats(): m_validated(0), m_rejectedEarly(0), m_memoHits(0) {}
+
+  void Add(const ValidationStats& other) { 
+    m_validated += other.m_validated; m_rejectedEarly += other.m_rejectedEarly; m_memoHits += other.m_memoHits; 
+  }
+  float EarlyRate() const                { return (m_validated > 0? (float)m_rejectedEarly/m_validated: 0); }
+  float MemoHitRate() const              { return (m_validated+m_memoHits > 0? (float)m_memoHits/(m_validated+m_memoHits): 0); }
+
+  int64_t m_validated;      /// Candidates validated (memo misses)
+  int64_t m_rejectedEarly;  /// Candidates rejected before their walks were complete
+  int64_t m_memoHits;       /// Candidates rejected by the memo without validation
+};
+
+/* Validates dmer matches by walking the site distances of both reads out from the dmers in both directions.
+ * Two cumulative lengths match when they differ by at most twice their tolerance, sqrt(mean*indelVariance)*cndfCoef rounded down,
+ * which is looked up by the sum of the two lengths in a table built once per parameter set; only longer sums compute it. 
+ * Validate stops walking once the matches still possible can no longer lift the score above the minimum score. */
 class DPMatcher{
 public:
-  DPMatcher() {} 
+  enum Verdict { Accepted, Rejected, RejectedEarly };
 
-  float FindMatch(const Dmer& dm1, const Dmer& dm2, const RSiteReads& reads, 
-                  float indelVariance, float cndfCoef, MatchInfo& mInfo,
-                  float& side1Score, float& side2Score) const; 
+  DPMatcher(): m_indelVariance(0), m_cndfCoef(0), m_minScore(0), m_tolerances() {} 
+  DPMatcher(float indelVariance, float cndfCoef, float minScore);
+
+  // Accepted if the score exceeds the minimum score; mInfo is only filled in unless rejected early (never with a negative minimum score)
+  Verdict Validate(const Dmer& dm1, const RSiteRead& read1, const Dmer& dm2, const RSiteRead& read2, MatchInfo& mInfo) const;
 private:
-  float FindMatch(int readIdx1, int readIdx2, int offset1, int offset2, bool matchDir, 
-                  const RSiteReads& reads, float indelVariance, float cndfCoef, MatchInfo& mInfo) const;
-  int LengthOfBases(int readIdx, int offset, bool dir, const RSiteReads& reads) const; //Find total length of bases for given region in given direction 
-  int GetRSiteLenForBaseLength(int readIdx, int offset, bool dir, int totLength, const RSiteReads& reads) const;
+  static const int s_tableSize = 1<<15;  // Sums of cumulative lengths with a tabulated tolerance
+
+  void MatchLengths(const RSiteRead& read1, const RSiteRead& read2, int offset1, int offset2, bool matchDir, int& length1, int& length2) const;
+  // Walk one direction, false if fewer than minMatches matches became certain (mInfo is then incomplete)
+  bool FindMatch(const RSiteRead& read1, const RSiteRead& read2, int offset1, int offset2, bool matchDir, int length1, int length2,
+                 int minMatches, MatchInfo& mInfo) const;
+  MatchInfo CombineMatches(const MatchInfo& mInfo1, const MatchInfo& mInfo2) const; // Forward and backward walk
+  int MinMatches(int seqLen) const;  // Fewest matches whose score exceeds the minimum score
+  int GetRSiteLenForBaseLength(const SiteWalk& walk, int siteLen, int totLength) const;
+  bool IsMatch(int cmt1, int cmt2) const {
+    int sum = cmt1 + cmt2;
+    if((unsigned)sum < (unsigned)m_tolerances.isize()) { return abs(cmt1-cmt2) <= m_tolerances[sum]; }
+    return IsMatchFloat(cmt1, cmt2);
+  }
+  bool IsMatchFloat(int cmt1, int cmt2) const; // Same decision taken in floating point (for sums beyond the table)
+  int Deviation(float average) const;
+
+  float m_indelVariance;        /// Variance of indels per base
+  float m_cndfCoef;             /// Coefficient of the tolerated deviation
+  float m_minScore;             /// Score a match has to exceed to be accepted
+  svec<int> m_tolerances;       /// Twice the tolerated deviation for every sum of two cumulative lengths
 };
 
 
@@ -0,0 +1,123 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include "DmerScan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DMERSCAN_X86
+#include <immintrin.h>
+#endif
+
+uint32_t DmerScan::MatchScalar(const int* lower, const int* upper, int dmerLength,
+                               const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  uint32_t mask = 0;
+  for(int k=0; k<count; k++) {
+    bool match = (seqs[k] != excludeSeq);
+    for(int d=0; d<dmerLength && match; d++) {
+      int value = values[d*stride+k];
+      match = (value >= lower[d] && value <= upper[d]);
+    }
+    mask |= (uint32_t)match << k;
+  }
+  return mask;
+}
+
+#ifdef DMERSCAN_X86
+
+uint32_t DmerScan::MatchSSE(const int* lower, const int* upper, int dmerLength,
+                            const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  uint32_t mask = 0;
+  __m128i exclude = _mm_set1_epi32(excludeSeq);
+  int k = 0;
+  for(; k+4<=count; k+=4) {
+    __m128i fail = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(seqs+k)), exclude);
+    for(int d=0; d<dmerLength; d++) {
+      __m128i value = _mm_loadu_si128((const __m128i*)(values+d*stride+k));
+      fail = _mm_or_si128(fail, _mm_cmpgt_epi32(_mm_set1_epi32(lower[d]), value));
+      fail = _mm_or_si128(fail, _mm_cmpgt_epi32(value, _mm_set1_epi32(upper[d])));
+    }
+    mask |= (uint32_t)(~_mm_movemask_ps(_mm_castsi128_ps(fail)) & 0xF) << k;
+  }
+  if(k < count) { mask |= MatchScalar(lower, upper, dmerLength, values+k, stride, seqs+k, count-k, excludeSeq) << k; }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+uint32_t DmerScan::MatchAVX2(const int* lower, const int* upper, int dmerLength,
+                             const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  // Masked loads never touch the lanes beyond count, so a partial block stays in AVX code 
+  // (handing it to the SSE kernel would pay for the switch between AVX and SSE state)
+  uint32_t mask = 0;
+  __m256i exclude = _mm256_set1_epi32(excludeSeq);
+  __m256i lanes   = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  for(int k=0; k<count; k+=8) {
+    __m256i load = _mm256_cmpgt_epi32(_mm256_set1_epi32(count-k), lanes);
+    __m256i fail = _mm256_cmpeq_epi32(_mm256_maskload_epi32(seqs+k, load), exclude);
+    for(int d=0; d<dmerLength; d++) {
+      __m256i value = _mm256_maskload_epi32(values+d*stride+k, load);
+      fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(_mm256_set1_epi32(lower[d]), value));
+      fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(value, _mm256_set1_epi32(upper[d])));
+    }
+    mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(fail, load))) << k;
+  }
+  return mask;
+}
+
+__attribute__((target("avx512f")))
+uint32_t DmerScan::MatchAVX512(const int* lower, const int* upper, int dmerLength,
+                               const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  // Masked loads never touch the lanes beyond count, so a partial block needs no scalar tail
+  __mmask16 match = (count >= 16? 0xFFFF: (__mmask16)((1u << count) - 1));
+  match = _mm512_mask_cmpneq_epi32_mask(match, _mm512_maskz_loadu_epi32(match, seqs), _mm512_set1_epi32(excludeSeq));
+  for(int d=0; d<dmerLength && match; d++) {
+    __m512i value = _mm512_maskz_loadu_epi32(match, values+d*stride);
+    match = _mm512_mask_cmpge_epi32_mask(match, value, _mm512_set1_epi32(lower[d]));
+    match = _mm512_mask_cmple_epi32_mask(match, value, _mm512_set1_epi32(upper[d]));
+  }
+  return match;
+}
+
+#else
+
+uint32_t DmerScan::MatchSSE(const int* lower, const int* upper, int dmerLength,
+                            const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  return MatchScalar(lower, upper, dmerLength, values, stride, seqs, count, excludeSeq);
+}
+
+uint32_t DmerScan::MatchAVX2(const int* lower, const int* upper, int dmerLength,
+                             const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  return MatchScalar(lower, upper, dmerLength, values, stride, seqs, count, excludeSeq);
+}
+
+uint32_t DmerScan::MatchAVX512(const int* lower, const int* upper, int dmerLength,
+                               const int* values, int stride, const int* seqs, int count, int excludeSeq) {
+  return MatchScalar(lower, upper, dmerLength, values, stride, seqs, count, excludeSeq);
+}
+
+#endif //DMERSCAN_X86
+
+static DmerScan::ScanFunc SelectScan() {
+#ifdef DMERSCAN_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) { return DmerScan::MatchAVX512; }
+  if(__builtin_cpu_supports("avx2"))    { return DmerScan::MatchAVX2;   }
+  return DmerScan::MatchSSE;
+#else
+  return DmerScan::MatchScalar;
+#endif
+}
+
+DmerScan::ScanFunc DmerScan::Best() {
+  static const ScanFunc best = SelectScan();
+  return best;
+}
+
+const char* DmerScan::Name(ScanFunc func) {
+#ifdef DMERSCAN_X86
+  if(func == MatchAVX512) { return "AVX-512"; }
+  if(func == MatchAVX2)   { return "AVX2";    }
+  if(func == MatchSSE)    { return "SSE2";    }
+#endif
+  return "scalar";
+}
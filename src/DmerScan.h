@@ -0,0 +1,31 @@
+#ifndef DMERSCAN_H
+#define DMERSCAN_H
+
+#include <stdint.h>
+
+/* Batch comparison of one query dmer against a block of up to BlockSize candidate dmers.
+ * Candidates are laid out dimension-major: the value of dimension d for candidate k is at values[d*stride+k].
+ * Bit k of the result is set if every value of candidate k lies within [lower[d], upper[d]]
+ * and its read index differs from excludeSeq (-1 excludes nothing). */
+class DmerScan
+{
+public:
+  static const int BlockSize = 16;  /// Most candidates tested per call
+
+  typedef uint32_t (*ScanFunc)(const int* lower, const int* upper, int dmerLength,
+                               const int* values, int stride, const int* seqs, int count, int excludeSeq);
+
+  static uint32_t MatchScalar(const int* lower, const int* upper, int dmerLength,
+                              const int* values, int stride, const int* seqs, int count, int excludeSeq);
+  static uint32_t MatchSSE(const int* lower, const int* upper, int dmerLength,
+                           const int* values, int stride, const int* seqs, int count, int excludeSeq);
+  static uint32_t MatchAVX2(const int* lower, const int* upper, int dmerLength,
+                            const int* values, int stride, const int* seqs, int count, int excludeSeq);
+  static uint32_t MatchAVX512(const int* lower, const int* upper, int dmerLength,
+                              const int* values, int stride, const int* seqs, int count, int excludeSeq);
+
+  static ScanFunc Best();                 // Widest kernel the CPU supports (selected once at runtime)
+  static const char* Name(ScanFunc func); // Name of the kernel for logging
+};
+
+#endif //DMERSCAN_H
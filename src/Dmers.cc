@@ -5,9 +5,12 @@
 #include "ryggrad/src/base/Logger.h"
 #include "Dmers.h"
 #include <math.h>
+#include <omp.h>
+#include <climits>
+#include <algorithm>
 
 bool Dmer::operator < (const Dmer & m) const {
-  for (int i=0; i<m_data.isize(); i++) {
+  for (int i=0; i<m_length; i++) {
     if (m_data[i] != m.m_data[i])
       return m_data[i] < m.m_data[i];
   }
@@ -15,7 +18,7 @@ bool Dmer::operator < (const Dmer & m) const {
 }
   
 bool Dmer::operator != (const Dmer & m) const {
-  for (int i=0; i<m_data.isize(); i++) {
+  for (int i=0; i<m_length; i++) {
     if (m_data[i] != m.m_data[i])
       return true;
   }
@@ -23,41 +26,298 @@ bool Dmer::operator != (const Dmer & m) const {
 }
 
 bool Dmer::operator == (const Dmer & m) const {
-  for (int i=0; i<m_data.isize(); i++) {
+  for (int i=0; i<m_length; i++) {
     if (m_data[i] != m.m_data[i])
       return false;
   }
   return true;
 }
 
-void Dmer::CalcDeviations(svec<int>& deviations, float indelVariance, float deviationCoeff) const {
-  if(deviations.isize() < m_data.isize()) { deviations.resize(m_data.isize()); }
-  for(int i=0; i<m_data.isize(); i++) {
-    int deviation = sqrt(m_data[i]*indelVariance)*deviationCoeff;
-    deviations[i] = deviation;
-  }
-}
-
 string Dmer::ToString() const {
   stringstream ss;
-  for (int i=0; i<m_data.isize(); i++)
+  for (int i=0; i<m_length; i++)
     ss << " " << m_data[i];
   ss << " seq: " << m_seq << " pos: " << m_pos;
   return ss.str();
 }
 
-void Dmers::BuildDmers(const RSiteReads& rReads , int dmerLength, int motifLength, int countPerDimension) { 
+void Dmers::BuildDmers(const RSiteReads& rReads , int dmerLength, int motifLength, int countPerDimension, bool forwardOnly) { 
   m_dmerLength = dmerLength;
   m_dimCount   = countPerDimension;
-  m_mers.resize(pow(m_dimCount, m_dmerLength)); // TODO Check to be within memory limit
   SetRangeBounds(motifLength);
   cout << "Building dmers ..." << endl;
   FILE_LOG(logINFO) << "LOG Build mer list...";
-  for (int rIdx=0; rIdx<rReads.NumReads(); rIdx++) {
-    AddSingleReadDmers(rReads[rIdx], rIdx);
+  double buildStart = omp_get_wtime();
+
+  // Every read's dmers occupy a fixed range, so reads can be handled independently (reads left out get an empty range)
+  int numReads = rReads.NumReads();
+  svec<int> readStarts;
+  readStarts.resize(numReads+1, 0);
+  for (int rIdx=0; rIdx<numReads; rIdx++) {
+    bool skipped = forwardOnly && rReads.IsReverse(rIdx);
+    readStarts[rIdx+1] = readStarts[rIdx] + (skipped? 0: max(0, rReads[rIdx].Size()-m_dmerLength+1));
+  }
+  m_dmerCount = readStarts[numReads];
+
+  // Each thread owns a contiguous range of reads holding about the same number of dmers
+  int numRanges = max(1, min(omp_get_max_threads(), m_dmerCount/s_minRangeDmers));
+  svec<int> rangeReads;
+  rangeReads.resize(numRanges+1, numReads);
+  for (int t=0; t<numRanges; t++) {
+    int firstMer  = (int)((int64_t)m_dmerCount*t/numRanges);
+    rangeReads[t] = upper_bound(readStarts.begin(), readStarts.end(), firstMer) - readStarts.begin() - 1;
+  }
+
+  // 1. Find the cell of every dmer and the occupied cells of each range
+  svec<int> merCells;
+  merCells.resize(m_dmerCount);
+  svec< svec<int> > rangeCells;
+  rangeCells.resize(numRanges);
+  #pragma omp parallel for num_threads(numRanges) schedule(static, 1)
+  for (int t=0; t<numRanges; t++) {
+    svec<int> dists;
+    for (int rIdx=rangeReads[t]; rIdx<rangeReads[t+1]; rIdx++) {
+      if(readStarts[rIdx] == readStarts[rIdx+1]) { continue; }
+      rReads[rIdx].GetDists(dists);
+      for (int pos=0; pos<=dists.isize()-m_dmerLength; pos++) {
+        merCells[readStarts[rIdx]+pos] = MapNToOneDim(&dists[pos]);
+      }
+    }
+    svec<int>& cells = rangeCells[t];
+    cells.assign(merCells.begin()+readStarts[rangeReads[t]], merCells.begin()+readStarts[rangeReads[t+1]]);
+    sort(cells.begin(), cells.end());
+    cells.erase(unique(cells.begin(), cells.end()), cells.end());
+  }
+  svec<int> cellIds;
+  for (int t=0; t<numRanges; t++) {
+    svec<int> merged;
+    merged.resize(cellIds.isize()+rangeCells[t].isize());
+    merged.erase(set_union(cellIds.begin(), cellIds.end(), rangeCells[t].begin(), rangeCells[t].end(), merged.begin()), merged.end());
+    cellIds.swap(merged);
+  }
+  m_cellIds.Adopt(cellIds);
+  BuildCellTable();
+
+  // 2. Count the dmers of every range per cell it occupies, then turn the counts into each range's first slot in the cell
+  //    (ranges follow each other within a cell, so the dmers of a cell stay in read order whatever the thread count).
+  //    Counts are kept per occupied cell of the range, as a dense table of every cell per range would outgrow the grid.
+  int numCells = NumCells();
+  svec< svec<int> > rangeFill;
+  rangeFill.resize(numRanges);
+  #pragma omp parallel for num_threads(numRanges) schedule(static, 1)
+  for (int t=0; t<numRanges; t++) {
+    svec<int>& cells  = rangeCells[t];
+    svec<int>& counts = rangeFill[t];
+    counts.resize(cells.isize(), 0);
+    for (int merCnt=readStarts[rangeReads[t]]; merCnt<readStarts[rangeReads[t+1]]; merCnt++) {
+      merCells[merCnt] = lower_bound(cells.begin(), cells.end(), merCells[merCnt]) - cells.begin(); // Slot in the range's cells
+      counts[merCells[merCnt]]++;
+    }
+    for (int j=0; j<cells.isize(); j++) { cells[j] = FindCell(cells[j]); }
+  }
+  svec<int> cellStarts;
+  cellStarts.resize(numCells+1, 0);
+  for (int t=0; t<numRanges; t++) {
+    for (int j=0; j<rangeCells[t].isize(); j++) { cellStarts[rangeCells[t][j]+1] += rangeFill[t][j]; }
+  }
+  for (int cellIdx=0; cellIdx<numCells; cellIdx++) {
+    cellStarts[cellIdx+1] += cellStarts[cellIdx];
   }
+  m_cellStarts.Adopt(cellStarts);
+  svec<int> cellFill;
+  cellFill.assign(m_cellStarts.begin(), m_cellStarts.end()-1);
+  for (int t=0; t<numRanges; t++) {
+    for (int j=0; j<rangeCells[t].isize(); j++) {
+      int count = rangeFill[t][j];
+      rangeFill[t][j] = cellFill[rangeCells[t][j]];
+      cellFill[rangeCells[t][j]] += count;
+    }
+  }
+  svec<int>().swap(cellFill);
+
+  // 3. Scatter the dmers of every range into the slots reserved for it
+  svec<int> merSeqs, merPos, merValues;
+  merSeqs.resize(m_dmerCount);
+  merPos.resize(m_dmerCount);
+  merValues.resize((int64_t)m_dmerCount*m_dmerLength);
+  #pragma omp parallel for num_threads(numRanges) schedule(static, 1)
+  for (int t=0; t<numRanges; t++) {
+    svec<int>& fill = rangeFill[t];
+    svec<int> dists;
+    for (int rIdx=rangeReads[t]; rIdx<rangeReads[t+1]; rIdx++) {
+      if(readStarts[rIdx] == readStarts[rIdx+1]) { continue; }
+      rReads[rIdx].GetDists(dists);
+      for (int pos=0; pos<=dists.isize()-m_dmerLength; pos++) {
+        int slot    = merCells[readStarts[rIdx]+pos];
+        int cellIdx = rangeCells[t][slot];
+        int merIdx  = fill[slot]++;
+        merSeqs[merIdx] = rIdx;
+        merPos[merIdx]  = pos;
+        int* values = merValues.data() + (int64_t)CellStart(cellIdx)*m_dmerLength + (merIdx-CellStart(cellIdx));
+        for (int j=0; j<m_dmerLength; j++) {
+          values[j*CellSize(cellIdx)] = dists[pos+j];
+        }
+      }
+    }
+  }
+  m_merSeqs.Adopt(merSeqs);
+  m_merPos.Adopt(merPos);
+  m_merValues.Adopt(merValues);
   cout << "Total number of dmers: " << NumMers() << endl;
-  FILE_LOG(logINFO) << "Total number of dmers: " << NumMers();
+  FILE_LOG(logINFO) << "Total number of dmers: " << NumMers() << (forwardOnly? " of forward reads": "") << " in " << NumCells() << " occupied cells using " 
+                    << MemoryBytes()/(1024*1024) << " MB, built in " << omp_get_wtime()-buildStart << " s on " << numRanges << " threads";
+}
+
+void Dmers::BuildCellTable() {
+  int tableSize = 16;
+  while(tableSize < 2*NumCells()) { tableSize *= 2; } // Keep the load factor at or below 0.5
+  svec<int> cellSlots;
+  cellSlots.resize(2*tableSize, -1);
+  int mask = tableSize - 1;
+  for (int cellIdx=0; cellIdx<NumCells(); cellIdx++) {
+    int slot = CellHash(m_cellIds[cellIdx]) & mask;
+    while(cellSlots[2*slot] != -1) { slot = (slot + 1) & mask; }
+    cellSlots[2*slot]   = m_cellIds[cellIdx];
+    cellSlots[2*slot+1] = cellIdx;
+  }
+  m_cellSlots.Adopt(cellSlots);
+}
+
+int Dmers::FindCell(int cellId) const {
+  int mask = m_cellSlots.isize()/2 - 1;
+  int slot = CellHash(cellId) & mask;
+  while(m_cellSlots[2*slot] != -1) {
+    if(m_cellSlots[2*slot] == cellId) { return m_cellSlots[2*slot+1]; }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+void Dmers::GetDmer(int cellIdx, int merIdx, Dmer& dmer) const {
+  dmer.Seq() = m_merSeqs[merIdx];
+  dmer.Pos() = m_merPos[merIdx];
+  dmer.SetLength(m_dmerLength);
+  const int* values = CellValues(cellIdx) + (merIdx-CellStart(cellIdx));
+  for (int j=0; j<m_dmerLength; j++) {
+    dmer[j] = values[j*CellSize(cellIdx)];
+  }
+}
+
+int64_t Dmers::MemoryBytes() const {
+  return m_cellIds.MemoryBytes() + m_cellStarts.MemoryBytes() + m_cellSlots.MemoryBytes() 
+         + m_merSeqs.MemoryBytes() + m_merPos.MemoryBytes() + m_merValues.MemoryBytes()
+         + (int64_t)sizeof(int) * (m_devTable.capacity() + m_merLower.capacity() + m_merUpper.capacity());
+}
+
+void Dmers::WriteIndex(IndexWriter& writer) const {
+  writer.WriteInt(m_dmerLength);
+  writer.WriteInt(m_dimCount);
+  writer.WriteInt(m_dmerCount);
+  writer.WriteArray(m_dimRangeBounds);
+  writer.WriteArray(m_valueBins);
+  writer.WriteArray(m_dimStrides);
+  writer.WriteArray(m_cellIds);
+  writer.WriteArray(m_cellStarts);
+  writer.WriteArray(m_cellSlots);
+  writer.WriteArray(m_merSeqs);
+  writer.WriteArray(m_merPos);
+  writer.WriteArray(m_merValues);
+}
+
+bool Dmers::MapIndex(IndexReader& reader, const RSiteReads& rReads, int dmerLength) {
+  // The small per-dimension tables are copied, the grid itself is used in place
+  m_dmerLength = reader.ReadInt();
+  m_dimCount   = reader.ReadInt();
+  m_dmerCount  = reader.ReadInt();
+  reader.ReadArray(m_dimRangeBounds);
+  reader.ReadArray(m_valueBins);
+  reader.ReadArray(m_dimStrides);
+  reader.ReadArray(m_cellIds);
+  reader.ReadArray(m_cellStarts);
+  reader.ReadArray(m_cellSlots);
+  reader.ReadArray(m_merSeqs);
+  reader.ReadArray(m_merPos);
+  reader.ReadArray(m_merValues);
+  m_devVariance = -1;
+  m_devCoeff    = -1;
+  svec<int>().swap(m_devTable);
+  svec<int>().swap(m_merLower);
+  svec<int>().swap(m_merUpper);
+  bool valid = (!reader.Failed() && m_dmerLength == dmerLength && m_dmerLength >= 1 && m_dmerLength <= Dmer::MaxLength 
+                && m_dimStrides.isize() == m_dmerLength && m_dmerCount >= 0 && m_cellStarts.Size() == m_cellIds.Size()+1 
+                && m_merSeqs.Size() == m_dmerCount && m_merPos.Size() == m_dmerCount && m_merValues.Size() == (int64_t)m_dmerCount*m_dmerLength
+                && IsConsistent(rReads));
+  if(!valid) { FILE_LOG(logERROR) << "Corrupt dmer grid in index file"; }
+  return valid;
+}
+
+bool Dmers::IsConsistent(const RSiteReads& rReads) const {
+  // Per-dimension tables: every site value falls in a bin of the grid and the strides are those of the grid
+  if(m_dimCount < 2 || m_dimRangeBounds.isize() != m_dimCount-1) { return false; }
+  for(int bin:m_valueBins) {
+    if(bin < 0 || bin >= m_dimCount) { return false; }
+  }
+  int64_t stride = 1;
+  for(int i=m_dmerLength-1; i>=0; i--) {
+    if(m_dimStrides[i] != stride) { return false; }
+    stride *= m_dimCount;
+    if(stride > INT_MAX) { return false; }
+  }
+  // Cells: increasing addresses, records partitioned in order and a lookup table with a free slot to end every probe
+  int numCells = NumCells();
+  if(m_cellStarts[0] != 0 || m_cellStarts[numCells] != m_dmerCount) { return false; }
+  for(int cellIdx=0; cellIdx<numCells; cellIdx++) {
+    if(m_cellStarts[cellIdx] > m_cellStarts[cellIdx+1] || (cellIdx > 0 && m_cellIds[cellIdx-1] >= m_cellIds[cellIdx])) { return false; }
+  }
+  int64_t tableSize = m_cellSlots.Size()/2;
+  if(m_cellSlots.Size() != 2*tableSize || tableSize <= numCells || (tableSize & (tableSize-1)) != 0) { return false; }
+  int64_t freeSlots = 0;
+  for(int64_t slot=0; slot<tableSize; slot++) {
+    if(m_cellSlots[2*slot] == -1) { freeSlots++; }
+    else if(m_cellSlots[2*slot+1] < 0 || m_cellSlots[2*slot+1] >= numCells) { return false; }
+  }
+  if(freeSlots == 0) { return false; }
+  // Dmers: every record lies within its read and holds site values
+  for(int merIdx=0; merIdx<m_dmerCount; merIdx++) {
+    if(m_merSeqs[merIdx] < 0 || m_merSeqs[merIdx] >= rReads.NumReads() || m_merPos[merIdx] < 0 
+       || m_merPos[merIdx] > rReads[m_merSeqs[merIdx]].Size()-m_dmerLength) { return false; }
+  }
+  for(int value:m_merValues) {
+    if(value < 0) { return false; }
+  }
+  return true;
+}
+
+void Dmers::BuildDeviations(float indelVariance, float deviationCoeff, bool storeBounds) {
+  if(indelVariance == m_devVariance && deviationCoeff == m_devCoeff && storeBounds == HasBounds()) { return; } // Already in place
+  m_devVariance = indelVariance;
+  m_devCoeff    = deviationCoeff;
+  int maxValue  = (m_merValues.empty()? 0: *max_element(m_merValues.begin(), m_merValues.end()));
+  m_devTable.clear();
+  m_devTable.resize(min(maxValue, s_maxTabulatedValue-1)+1);
+  for (int value=0; value<m_devTable.isize(); value++) {
+    m_devTable[value] = CalcDeviation(value);
+  }
+
+  svec<int>().swap(m_merLower);
+  svec<int>().swap(m_merUpper);
+  if(storeBounds) {
+    m_merLower.resize(m_merValues.isize());
+    m_merUpper.resize(m_merValues.isize());
+    for (int cellIdx=0; cellIdx<NumCells(); cellIdx++) {
+      const int* values = CellValues(cellIdx);
+      for (int merIdx=CellStart(cellIdx); merIdx<CellEnd(cellIdx); merIdx++) {
+        for (int j=0; j<m_dmerLength; j++) {
+          int value = values[j*CellSize(cellIdx) + merIdx-CellStart(cellIdx)];
+          m_merLower[(int64_t)merIdx*m_dmerLength+j] = value - Deviation(value);
+          m_merUpper[(int64_t)merIdx*m_dmerLength+j] = value + Deviation(value);
+        }
+      }
+    }
+  }
+  FILE_LOG(logINFO) << "Deviation table for site values up to " << m_devTable.isize()-1 << " using " << sizeof(int)*m_devTable.capacity()/1024 
+                    << " KB, per-dmer bounds " << (storeBounds? "stored": "not stored") << " using " 
+                    << sizeof(int)*(m_merLower.capacity()+m_merUpper.capacity())/(1024*1024) << " MB";
 }
 
 void Dmers::SetRangeBounds(int motifSize) {
@@ -66,52 +326,47 @@ void Dmers::SetRangeBounds(int motifSize) {
   double pC     = 0;                       // Cumulative probability
   int rangeLim  = 0;
 
+  m_valueBins.clear();
+  m_valueBins.push_back(0);
   for(int dim=0; dim<m_dimCount-1; dim++) {
     while(pC < (double)(dim+1)/m_dimCount) {
       double pi = pow(p2, rangeLim+1) * p1;
       pC += pi;
       rangeLim++;
-      m_dmerCellMap[rangeLim] = dim;
+      m_valueBins.push_back(dim);
     }
     m_dimRangeBounds.push_back(rangeLim); 
     FILE_LOG(logDEBUG1) << "Dimension Range: " << m_dimRangeBounds.isize()-1 << "  " << rangeLim; 
   }
-}
+  m_valueBins.resize(rangeLim); // Values at or beyond the last range bound belong to the last bin
 
-void Dmers::AddSingleReadDmers(const RSiteRead& rRead, int rIdx) {
-  svec<Dmer> dmers;
-  GenerateDmers(rRead, rIdx, dmers);
-  for (Dmer dm:dmers) {
-    int merLoc = MapNToOneDim(dm.Data());
-    m_mers[merLoc].push_back(dm);
-    m_dmerCount++;
+  m_dimStrides.resize(m_dmerLength);
+  int stride = 1;
+  for(int i=m_dmerLength-1; i>=0; i--) {
+    m_dimStrides[i] = stride;
+    stride         *= m_dimCount;
   }
-  FILE_LOG(logDEBUG3) << "Read Index: " << rIdx << " total dmers so far: " << m_dmerCount << endl;
 }
 
 void Dmers::GenerateDmers(const RSiteRead& rRead, int rIdx, svec<Dmer>& dmers) const {
   Dmer mm;
   mm.Seq() = rIdx;
-  mm.Data().resize(m_dmerLength);
-  int loopLim = rRead.Dist().isize() - m_dmerLength;
+  mm.SetLength(m_dmerLength);
+  int loopLim = rRead.Size() - m_dmerLength;
   for (int i=0; i<=loopLim; i++) {
     mm.Pos() = i;
     for (int j=0; j<m_dmerLength; j++) {
-      mm.Data()[j] = rRead.Dist()[i+j];
+      mm[j] = rRead[i+j];
     }
     dmers.push_back(mm);
   }
 }
 
-int Dmers::MapNToOneDim(const svec<int>& nDims) const {
+int Dmers::MapNToOneDim(const int* nDims) const {
   // This function does not do bound checking and assumes that nDims size is m_dmerLength and values are between 0 and m_dimCount
   int mapVal = 0;
-  int coeff  = pow(m_dimCount, m_dmerLength-1);
   for(int i=0; i<m_dmerLength; i++) {
-    int qVal = m_dimCount - 1; // First set it to the highest possible digit and then check if it belongs in another cell 
-    if(nDims[i] < m_dimRangeBounds[m_dimCount-2])  { qVal = m_dmerCellMap.at(nDims[i]); } // the last digit range bound is in m_dimCount-2
-    mapVal += qVal * coeff;
-    coeff  /= m_dimCount;
+    mapVal += ValueBin(nDims[i]) * m_dimStrides[i];
   }
   return mapVal;
 }
@@ -127,25 +382,27 @@ svec<int> Dmers::MapOneToNDim(int oneDMappedVal) const {
   return nDims;
 }
 
-void Dmers::FindNeighbourCells(int initVal, const Dmer& dmer, const svec<int>& deviations, svec<int>& result) const {
-  FindNeighbourCells(initVal, dmer, deviations, m_dmerLength-1, result);
+int Dmers::MaxNeighbourCells(bool lowerNeighbours) const {
+  int maxCells = 1;
+  for(int i=0; i<m_dmerLength; i++) {
+    maxCells *= (lowerNeighbours? 3: 2);
+  }
+  return maxCells;
 }
 
-void Dmers::FindNeighbourCells(int initVal, const Dmer& dmer, const svec<int>& deviations, int depth, svec<int>& result) const {
-  if(depth == -1) { 
-    result.push_back(initVal);
-    return;
-  }
-  FindNeighbourCells(initVal, dmer, deviations, depth-1, result);
-  svec<int> tempResult = result;
-  int currDigit = m_dimCount - 1; // First set it to the highest possible digit and then check if it belongs in another cell 
-  if(dmer[depth] < m_dimRangeBounds[m_dimCount-2])  { currDigit = m_dmerCellMap.at(dmer[depth]); } // the last digit range bound is in m_dimCount-2
-  if((currDigit < m_dimCount-2)  //only add one to the current digit if it has room to be increased 
-    && (dmer[depth]+deviations[depth] > m_dimRangeBounds[currDigit])) { // only try one cell up if the deviation limits don't fall within the same cell
-    for(int elem:tempResult) {
-      int newElem = elem + pow(m_dimCount, (m_dmerLength-1-depth));
-      result.push_back(newElem);
+int Dmers::FindNeighbourCells(int initVal, const Dmer& dmer, const int* deviations, bool lowerNeighbours, int* result) const {
+  // Each dimension whose deviation limits cross into the next (or previous) bin repeats the cells found so far shifted by one bin
+  int cellCount = 0;
+  result[cellCount++] = initVal;
+  for(int depth=0; depth<m_dmerLength; depth++) {
+    int currDigit = ValueBin(dmer[depth]);
+    int prevCount = cellCount;
+    if(currDigit < m_dimCount-1 && dmer[depth]+deviations[depth] > m_dimRangeBounds[currDigit]) {
+      for(int i=0; i<prevCount; i++) { result[cellCount++] = result[i] + m_dimStrides[depth]; }
+    }
+    if(lowerNeighbours && currDigit > 0 && dmer[depth]-deviations[depth] <= m_dimRangeBounds[currDigit-1]) {
+      for(int i=0; i<prevCount; i++) { result[cellCount++] = result[i] - m_dimStrides[depth]; }
     }
   }
+  return cellCount;
 }
-
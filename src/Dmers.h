@@ -1,16 +1,19 @@
 #ifndef DMER_H
 #define DMER_H
 
+#include <stdint.h>
 #include <map>
 #include <string>
+#include <math.h>
 #include "RSiteReads.h"
+#include "IndexFile.h"
 
+/* A dmer keeps its site values inline (up to MaxLength of them) so that it can be copied without allocation. */
 class Dmer {
 public:
-  Dmer() {
-    m_seq = -1;
-    m_pos = -1;
-  }
+  static const int MaxLength = 12;  /// Longest supported dmer length
+
+  Dmer(): m_length(0), m_seq(-1), m_pos(-1) {}
 
   bool operator <  (const Dmer & m) const;
   bool operator != (const Dmer & m) const; 
@@ -24,53 +27,90 @@ public:
   const int & Seq() const {return m_seq;}
   const int & Pos() const {return m_pos;}
  
-  svec<int> & Data() {return m_data;}
-  const svec<int> & Data() const {return m_data;}
+  int Length() const            { return m_length;   }
+  void SetLength(int length)    { m_length = length; }
+  int* Data()                   { return m_data;     }
+  const int* Data() const       { return m_data;     }
 
-  inline bool IsMatch(const Dmer& otherDmer, const svec<int>& deviations, bool allowSame) const {
-    if(!allowSame && m_seq == otherDmer.m_seq) { return false; } // Same sequence is not a real match
-    for(int i=0; i<m_data.isize(); i++) {
-      if (m_data[i] < otherDmer.m_data[i]-deviations[i] || m_data[i] > otherDmer.m_data[i]+deviations[i])
-        return false;
-    }
-    return true;
-  }
-  void CalcDeviations(svec<int>& deviations, float indelVariance, float deviationCoeff) const; 
   string ToString() const; 
 
 private:
-  svec<int> m_data;
-  int m_seq;
-  int m_pos;
+  int m_data[MaxLength];  /// Site values
+  int m_length;           /// Number of site values in use
+  int m_seq;              /// Index of the read the dmer belongs to
+  int m_pos;              /// Offset of the dmer in its read
 };
 
+/* Dmers projected onto a multi-dimensional grid of cells, kept in compressed sparse row form:
+ * only occupied cells are stored, each owning a contiguous range of the flat dmer record arrays.
+ * Within a cell the site values are stored dimension-major (all first values, then all second values...)
+ * so that a block of candidates can be compared against a query in one batch (see DmerScan).
+ * The flat arrays are either built in memory or used in place from a memory-mapped index file (see IndexFile). */
 class Dmers {
 public:
-  Dmers(): m_mers(), m_dimCount(0), m_dmerLength(0), m_dimRangeBounds(), m_dmerCellMap(), m_dmerCount(0) {}
+  Dmers(): m_cellIds(), m_cellStarts(), m_cellSlots(), m_merSeqs(), m_merPos(), m_merValues(), 
+           m_dimCount(0), m_dmerLength(0), m_dimRangeBounds(), m_valueBins(), m_dimStrides(), m_dmerCount(0),
+           m_devTable(), m_devVariance(-1), m_devCoeff(-1), m_merLower(), m_merUpper() {}
 
-  int NumMers() const                      { return m_dmerCount;     }
-  int NumCells() const                     { return m_mers.isize();  }
-  svec<Dmer> operator[](int index) const   { return m_mers[index];   }
-  svec<Dmer>& operator[](int index)        { return m_mers[index];   }
+  int NumMers() const                      { return m_dmerCount;                                }
+  int NumCells() const                     { return m_cellIds.isize();                          } // Number of occupied cells
+  int CellId(int cellIdx) const            { return m_cellIds[cellIdx];                         } // Grid address of an occupied cell
+  int CellStart(int cellIdx) const         { return m_cellStarts[cellIdx];                      } // Index of the first dmer in the cell
+  int CellEnd(int cellIdx) const           { return m_cellStarts[cellIdx+1];                    } // One past the last dmer in the cell
+  int CellSize(int cellIdx) const          { return CellEnd(cellIdx) - CellStart(cellIdx);      }
+  int MerSeq(int merIdx) const             { return m_merSeqs[merIdx];                          }
+  int MerPos(int merIdx) const             { return m_merPos[merIdx];                           }
+  const int* CellSeqs(int cellIdx) const   { return m_merSeqs.Data() + CellStart(cellIdx);      } // Read indices of the dmers in the cell
+  const int* CellValues(int cellIdx) const { return m_merValues.Data() + (int64_t)CellStart(cellIdx)*m_dmerLength; } // Values with a stride of CellSize
+  int64_t MemoryBytes() const;
+  int Deviation(int value) const           { return (value < m_devTable.isize()? m_devTable[value]: CalcDeviation(value)); }
+  bool HasBounds() const                   { return !m_merLower.empty();                        }
+  const int* MerLower(int merIdx) const    { return &m_merLower[(int64_t)merIdx*m_dmerLength];  } // Lowest value matching each site of the dmer
+  const int* MerUpper(int merIdx) const    { return &m_merUpper[(int64_t)merIdx*m_dmerLength];  } // Highest value matching each site of the dmer
 
-  void BuildDmers(const RSiteReads& rReads, int dmerLength, int motifLength, int countPerDimension); 
-  void FindNeighbourCells(int initVal, const Dmer& dmer, const svec<int>& deviations, svec<int>& result) const; 
+  // Dmers of all reads, or of the forward reads only (reverse complements are then searched for with flipped dmers)
+  void BuildDmers(const RSiteReads& rReads, int dmerLength, int motifLength, int countPerDimension, bool forwardOnly); 
+  void BuildDeviations(float indelVariance, float deviationCoeff, bool storeBounds); // Tabulate the allowed deviation per site value
+  void WriteIndex(IndexWriter& writer) const; // Store the grid in an index file
+  // Use the grid stored in a mapped index file in place, false if it is corrupt or does not fit the reads and dmer length given
+  bool MapIndex(IndexReader& reader, const RSiteReads& rReads, int dmerLength);
+  int FindCell(int cellId) const;                     // Index of the occupied cell at the given grid address or -1 if empty
+  void GetDmer(int cellIdx, int merIdx, Dmer& dmer) const; // Fill in the dmer object from the flat records of its cell
+  int MaxNeighbourCells(bool lowerNeighbours) const; // Size of the buffer FindNeighbourCells may need
+  int FindNeighbourCells(int initVal, const Dmer& dmer, const int* deviations, bool lowerNeighbours, int* result) const; // Returns the cell count
   void GenerateDmers(const RSiteRead& rRead, int rIdx, svec<Dmer>& dmers) const;
-  int MapNToOneDim(const svec<int>& nDims) const;
+  int MapNToOneDim(const int* nDims) const;
+  int ValueBin(int value) const            { return (value < m_valueBins.isize()? m_valueBins[value]: m_dimCount-1); } // Bin of a site value in any dimension
   svec<int> MapOneToNDim(int oneDMappedVal) const;
 
 protected:
   void SetRangeBounds(int motifLength);
-  void AddSingleReadDmers(const RSiteRead& rRead, int rIdx);
-  void FindNeighbourCells(int initVal, const Dmer& dmer, const svec<int>& deviations, int depth, svec<int>& result) const; 
+  void BuildCellTable();
+  bool IsConsistent(const RSiteReads& rReads) const; // Whether a mapped grid can be searched safely (every lookup stays in bounds)
 
 private:
-  svec<svec<Dmer> > m_mers;    /// Multi-dimensional matrix representation of dmers projected on to dimensions
+  static uint32_t CellHash(int cellId)  { return (uint32_t)cellId * 2654435761u; }
+  static const int s_maxTabulatedValue = 1<<16;  // Rarer larger site values have their deviation computed on demand
+  static const int s_minRangeDmers = 1<<16;      // Fewest dmers worth handing to a thread of their own while building
+  int CalcDeviation(int value) const   { return sqrt(value*m_devVariance)*m_devCoeff; }
+
+  FlatArray<int> m_cellIds;    /// Grid addresses of the occupied cells in increasing order
+  FlatArray<int> m_cellStarts; /// Offsets of each occupied cell into the dmer records (one extra entry marking the end)
+  FlatArray<int> m_cellSlots;  /// Open-addressing table of (grid address, occupied cell index) pairs for cell lookup
+  FlatArray<int> m_merSeqs;    /// Read index of every dmer, grouped by cell
+  FlatArray<int> m_merPos;     /// Offset in its read of every dmer, grouped by cell
+  FlatArray<int> m_merValues;  /// Site values of every dmer (m_dmerLength per dmer), grouped by cell and dimension-major within a cell
   int m_dimCount;              /// Number of cells in each dimension (this is dependent on the site values and the reduction coefficient)
   int m_dmerLength;            /// Number of dimensions in the matrix (i.e. dmer length)
   svec<int> m_dimRangeBounds;  /// The range limits for dmer values to be placed in each dimennsion
-  map<int, int> m_dmerCellMap; /// Mapping every dmer value to the relevant cell placement
+  svec<int> m_valueBins;       /// Bin of every site value below the last range bound (larger values fall in the last bin)
+  svec<int> m_dimStrides;      /// Distance between grid addresses of neighbouring cells in each dimension
   int m_dmerCount;             /// Total number of dmers
+  svec<int> m_devTable;        /// Allowed deviation for every site value up to the largest one in the index
+  float m_devVariance;         /// Indel variance the deviations have been computed for
+  float m_devCoeff;            /// Deviation coefficient the deviations have been computed for
+  svec<int> m_merLower;        /// Optional lower bound of every site value of every dmer (m_dmerLength per dmer), grouped by cell
+  svec<int> m_merUpper;        /// Optional upper bound of every site value of every dmer (m_dmerLength per dmer), grouped by cell
 };
 
 #endif //DMER_H
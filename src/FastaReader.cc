@@ -0,0 +1,140 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ryggrad/src/base/Logger.h"
+#include "FastaReader.h"
+
+bool FastaReader::Open(const string& fileName) {
+  Close();
+  if(fileName == "-") {
+    m_gzFile = gzdopen(dup(STDIN_FILENO), "rb");
+  } else {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd < 0) {
+      FILE_LOG(logERROR) << "Could not open input file: " << fileName;
+      return false;
+    }
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0) {
+      void* map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(map != MAP_FAILED) {
+        m_map     = (char*)map;
+        m_mapSize = fileStat.st_size;
+        if(m_mapSize >= 2 && (unsigned char)m_map[0] == 0x1f && (unsigned char)m_map[1] == 0x8b) { // gzip magic number
+          munmap(m_map, m_mapSize);
+          m_map     = NULL;
+          m_mapSize = 0;
+        } else {
+          madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+          m_end = m_mapSize;
+        }
+      }
+    }
+    if(m_map == NULL) {
+      lseek(fd, 0, SEEK_SET);
+      m_gzFile = gzdopen(dup(fd), "rb"); // Also reads uncompressed data from pipes
+    }
+    close(fd);
+  }
+  if(m_map == NULL) {
+    if(m_gzFile == NULL) {
+      FILE_LOG(logERROR) << "Could not read input file: " << fileName;
+      return false;
+    }
+    gzbuffer(m_gzFile, s_bufferSize);
+    m_buffer.resize(s_bufferSize);
+  }
+  FILE_LOG(logINFO) << "Reading " << fileName << (IsMapped()? " (memory-mapped)": " (streamed)");
+  return true;
+}
+
+void FastaReader::Close() {
+  if(m_map != NULL)    { munmap(m_map, m_mapSize); }
+  if(m_gzFile != NULL) { gzclose(m_gzFile);        }
+  m_map      = NULL;
+  m_mapSize  = 0;
+  m_released = 0;
+  m_gzFile   = NULL;
+  m_pos      = 0;
+  m_end      = 0;
+  m_inRecord = false;
+}
+
+bool FastaReader::Fill() {
+  if(m_gzFile == NULL) { return false; } // The whole mapped file is available already
+  int count = gzread(m_gzFile, &m_buffer[0], s_bufferSize);
+  if(count < 0) {
+    int errNum;
+    FILE_LOG(logERROR) << "Failed reading input: " << gzerror(m_gzFile, &errNum);
+    count = 0;
+  }
+  m_pos = 0;
+  m_end = count;
+  return count > 0;
+}
+
+void FastaReader::Release() {
+  if(m_map == NULL || m_pos-m_released < s_releaseSize) { return; }
+  int64_t pageSize = sysconf(_SC_PAGESIZE);
+  int64_t releaseEnd = m_pos / pageSize * pageSize;
+  madvise(m_map+m_released, releaseEnd-m_released, MADV_DONTNEED);
+  m_released = releaseEnd;
+}
+
+bool FastaReader::NextRecord(string& name) {
+  Release();
+  m_inRecord = false;
+  // Skip whatever is left of the current record up to the next header
+  while(true) {
+    if(m_pos == m_end && !Fill()) { return false; }
+    const char* start  = (IsMapped()? m_map: &m_buffer[0]) + m_pos;
+    const char* header = (const char*)memchr(start, '>', m_end-m_pos);
+    if(header != NULL) {
+      m_pos += header - start + 1;
+      break;
+    }
+    m_pos = m_end;
+  }
+  name.clear();
+  while(m_pos < m_end || Fill()) {
+    const char* start = (IsMapped()? m_map: &m_buffer[0]) + m_pos;
+    const char* eol   = (const char*)memchr(start, '\n', m_end-m_pos);
+    if(eol == NULL) {
+      name.append(start, m_end-m_pos);
+      m_pos = m_end;
+    } else {
+      name.append(start, eol-start);
+      m_pos += eol - start + 1;
+      break;
+    }
+  }
+  if(!name.empty() && name[name.size()-1] == '\r') { name.erase(name.size()-1); }
+  m_inRecord = true;
+  return true;
+}
+
+bool FastaReader::NextChunk(const char*& data, int& len) {
+  Release();
+  if(!m_inRecord) { return false; }
+  if(m_pos == m_end && !Fill()) {
+    m_inRecord = false;
+    return false;
+  }
+  const char* start  = (IsMapped()? m_map: &m_buffer[0]) + m_pos;
+  int64_t available  = min(m_end-m_pos, (int64_t)1<<30); // Keep chunk lengths within int
+  const char* header = (const char*)memchr(start, '>', available);
+  if(header == start) {
+    m_inRecord = false;
+    return false;
+  }
+  data = start;
+  len  = (header == NULL? available: header-start);
+  m_pos += len;
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef FASTAREADER_H
+#define FASTAREADER_H
+
+#include <string>
+#include <zlib.h>
+#include "ryggrad/src/base/SVector.h"
+
+/* Sequential reader of FASTA records that never holds a whole sequence in memory.
+ * Regular uncompressed files are memory-mapped and handed out in place (consumed pages are released as reading
+ * progresses); pipes, standard input ("-") and gzip files are streamed through a fixed size buffer instead.
+ * Sequence chunks are the raw bytes of the file, so they may contain line breaks and lower case bases. */
+class FastaReader
+{
+public:
+  FastaReader(): m_map(NULL), m_mapSize(0), m_released(0), m_gzFile(NULL), m_buffer(), m_pos(0), m_end(0), m_inRecord(false) {}
+  ~FastaReader() { Close(); }
+
+  bool Open(const string& fileName);
+  void Close();
+  bool IsMapped() const { return m_map != NULL; }
+
+  bool NextRecord(string& name);               // Skip to the next record and read its name, false at the end of the input
+  bool NextChunk(const char*& data, int& len); // Next piece of the current record's sequence, false at the end of the record
+
+private:
+  static const int s_bufferSize = 1<<20;        // Size of the streaming buffer
+  static const int64_t s_releaseSize = 1<<26;   // Give consumed mapped pages back once this many have accumulated
+
+  bool Fill();                                  // Refill the streaming buffer, false at the end of the input
+  void Release();                               // Release the mapped pages that have been consumed
+
+  char* m_map;          /// Mapped file contents (NULL when streaming)
+  int64_t m_mapSize;    /// Size of the mapped file
+  int64_t m_released;   /// Mapped bytes that have been given back to the system
+  gzFile m_gzFile;      /// Streamed input (NULL when mapped)
+  svec<char> m_buffer;  /// Streaming buffer
+  int64_t m_pos;        /// Read position in the mapped file or streaming buffer
+  int64_t m_end;        /// End of the valid data in the mapped file or streaming buffer
+  bool m_inRecord;      /// Whether the read position is inside a record's sequence
+};
+
+#endif //FASTAREADER_H
@@ -0,0 +1,149 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ryggrad/src/base/Logger.h"
+#include "IndexFile.h"
+
+bool IndexFile::IsIndex(const string& fileName) {
+  FILE* pFile = fopen(fileName.c_str(), "rb");
+  if(pFile == NULL) { return false; }
+  char magic[8];
+  bool isIndex = (fread(magic, 1, sizeof(magic), pFile) == sizeof(magic) && memcmp(magic, Magic(), sizeof(magic)) == 0);
+  fclose(pFile);
+  return isIndex;
+}
+
+bool IndexWriter::Open(const string& fileName) {
+  Close();
+  m_file = fopen(fileName.c_str(), "wb");
+  if(m_file == NULL) {
+    FILE_LOG(logERROR) << "Could not create index file: " << fileName;
+    return false;
+  }
+  m_pos    = 0;
+  m_failed = false;
+  Write(IndexFile::Magic(), 8);
+  WriteInt(IndexFile::s_version);
+  return !m_failed;
+}
+
+bool IndexWriter::Close() {
+  if(m_file == NULL) { return !m_failed; }
+  if(fclose(m_file) != 0) { m_failed = true; }
+  m_file = NULL;
+  return !m_failed;
+}
+
+void IndexWriter::Write(const void* data, int64_t bytes) {
+  if(bytes > 0 && fwrite(data, 1, bytes, m_file) != (size_t)bytes) { m_failed = true; }
+  m_pos += bytes;
+}
+
+void IndexWriter::WriteInt(int64_t value) {
+  Write(&value, sizeof(value));
+}
+
+void IndexWriter::WriteFloat(double value) {
+  Write(&value, sizeof(value));
+}
+
+void IndexWriter::WriteString(const string& value) {
+  WriteInt(value.size());
+  Write(value.data(), value.size());
+}
+
+void IndexWriter::WriteArrayBytes(const void* data, int64_t count, int elemSize) {
+  static const char padding[IndexFile::s_alignment] = {0};
+  WriteInt(count);
+  Write(padding, (IndexFile::s_alignment - m_pos%IndexFile::s_alignment) % IndexFile::s_alignment);
+  Write(data, count*elemSize);
+}
+
+bool IndexReader::Open(const string& fileName) {
+  Close();
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if(fd < 0) {
+    FILE_LOG(logERROR) << "Could not open index file: " << fileName;
+    return false;
+  }
+  struct stat fileStat;
+  if(fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+    // Shared read-only pages let concurrent jobs on the same index use one copy in the page cache
+    void* map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED) {
+      m_map  = (char*)map;
+      m_size = fileStat.st_size;
+    }
+  }
+  close(fd);
+  if(m_map == NULL) {
+    FILE_LOG(logERROR) << "Could not map index file: " << fileName;
+    return false;
+  }
+  const char* magic = Read(8);
+  if(m_failed || memcmp(magic, IndexFile::Magic(), 8) != 0) {
+    FILE_LOG(logERROR) << "Not an index file: " << fileName;
+    Close();
+    return false;
+  }
+  int version = ReadInt();
+  if(version != IndexFile::s_version) {
+    FILE_LOG(logERROR) << "Index file " << fileName << " has format version " << version << ", expected " << IndexFile::s_version;
+    Close();
+    return false;
+  }
+  FILE_LOG(logINFO) << "Mapped index file " << fileName << " (" << m_size/(1024*1024) << " MB)";
+  return true;
+}
+
+void IndexReader::Close() {
+  if(m_map != NULL) { munmap(m_map, m_size); }
+  m_map    = NULL;
+  m_size   = 0;
+  m_pos    = 0;
+  m_failed = false;
+}
+
+const char* IndexReader::Read(int64_t bytes) {
+  if(m_failed || bytes < 0 || bytes > m_size-m_pos) {
+    m_failed = true;
+    static const char zeros[IndexFile::s_alignment] = {0};
+    return zeros; // Callers check Failed() once they are done, so hand out something harmless meanwhile
+  }
+  const char* data = m_map + m_pos;
+  m_pos += bytes;
+  return data;
+}
+
+int64_t IndexReader::ReadInt() {
+  int64_t value;
+  memcpy(&value, Read(sizeof(value)), sizeof(value));
+  return value;
+}
+
+double IndexReader::ReadFloat() {
+  double value;
+  memcpy(&value, Read(sizeof(value)), sizeof(value));
+  return value;
+}
+
+string IndexReader::ReadString() {
+  int64_t len = ReadInt();
+  const char* data = Read(len);
+  return (m_failed? string(): string(data, len));
+}
+
+const char* IndexReader::ReadArrayBytes(int64_t& count, int elemSize) {
+  count = ReadInt();
+  Read((IndexFile::s_alignment - m_pos%IndexFile::s_alignment) % IndexFile::s_alignment);
+  if(count < 0 || count > (m_size-m_pos)/elemSize) { m_failed = true; } // Checked before multiplying, which could wrap around
+  const char* data = Read(m_failed? 0: count*elemSize);
+  if(m_failed) { count = 0; }
+  return data;
+}
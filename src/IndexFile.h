@@ -0,0 +1,138 @@
+#ifndef INDEXFILE_H
+#define INDEXFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "ryggrad/src/base/SVector.h"
+
+/* Flat read-only array that either owns its elements or refers to them in place inside a memory-mapped index file.
+ * Built arrays are handed over with Adopt or grown with Append, mapped ones are attached with Map; readers cannot tell the difference. */
+template<class T>
+class FlatArray
+{
+public:
+  FlatArray(): m_owned(), m_data(NULL), m_size(0), m_mapped(false) {}
+  FlatArray(const FlatArray& other): m_owned(), m_data(NULL), m_size(0), m_mapped(false) { *this = other; }
+
+  FlatArray& operator = (const FlatArray& other) {
+    m_owned  = other.m_owned;
+    m_mapped = other.m_mapped;
+    m_data   = (m_mapped? other.m_data: m_owned.data());
+    m_size   = other.m_size;
+    return *this;
+  }
+
+  const T& operator[](int64_t idx) const { return m_data[idx];       }
+  const T* Data() const                  { return m_data;            }
+  const T* begin() const                 { return m_data;            }
+  const T* end() const                   { return m_data + m_size;   }
+  int isize() const                      { return (int)m_size;       }
+  int64_t Size() const                   { return m_size;            }
+  bool empty() const                     { return m_size == 0;       }
+  bool IsMapped() const                  { return m_mapped;          }
+  int64_t MemoryBytes() const            { return sizeof(T)*m_owned.capacity(); } // Mapped elements live in the page cache
+
+  void Adopt(svec<T>& values) { // Take over the elements (values is left empty)
+    m_owned.swap(values);
+    svec<T>().swap(values);
+    m_data   = m_owned.data();
+    m_size   = m_owned.size();
+    m_mapped = false;
+  }
+  void Map(const T* data, int64_t size) { // Refer to elements owned by a mapping that outlives the array
+    svec<T>().swap(m_owned);
+    m_data   = data;
+    m_size   = size;
+    m_mapped = true;
+  }
+  void Append(const T* first, const T* last) { // Grow an owned array (mapped arrays cannot grow)
+    m_owned.insert(m_owned.end(), first, last);
+    m_data   = m_owned.data();
+    m_size   = m_owned.size();
+  }
+  void Append(const T& value) { Append(&value, &value+1); }
+  void Clear() { svec<T> none; Adopt(none); }
+
+private:
+  svec<T> m_owned;  /// Elements owned by the array (empty when mapped)
+  const T* m_data;  /// First element
+  int64_t m_size;   /// Number of elements
+  bool m_mapped;    /// Whether the elements belong to a mapped file
+};
+
+/* Binary index files hold scalars, strings and arrays in the order they are written, behind a magic string and
+ * a format version. Array contents start on a 64 byte boundary so that they can be used in place once mapped. */
+class IndexFile
+{
+public:
+  static const char* Magic()                  { return "SLAPSIDX"; }
+  static const int s_version   = 3;            // Bumped whenever the layout of the file changes
+  static const int s_alignment = 64;           // Alignment of array contents within the file
+
+  static bool IsIndex(const string& fileName); // Whether the file starts like an index file
+};
+
+class IndexWriter
+{
+public:
+  IndexWriter(): m_file(NULL), m_pos(0), m_failed(false) {}
+  ~IndexWriter() { Close(); }
+
+  bool Open(const string& fileName);  // Create the file and write the header
+  bool Close();                       // False if anything could not be written
+
+  void WriteInt(int64_t value);
+  void WriteFloat(double value);
+  void WriteString(const string& value);
+  template<class T> void WriteArray(const T* data, int64_t count) { WriteArrayBytes(data, count, sizeof(T)); }
+  template<class T> void WriteArray(const svec<T>& values)        { WriteArrayBytes(values.data(), values.size(), sizeof(T)); }
+  template<class T> void WriteArray(const FlatArray<T>& values)   { WriteArrayBytes(values.Data(), values.Size(), sizeof(T)); }
+
+private:
+  void Write(const void* data, int64_t bytes);
+  void WriteArrayBytes(const void* data, int64_t count, int elemSize);
+
+  FILE* m_file;     /// Output file
+  int64_t m_pos;    /// Bytes written so far
+  bool m_failed;    /// Whether a write has failed
+};
+
+class IndexReader
+{
+public:
+  IndexReader(): m_map(NULL), m_size(0), m_pos(0), m_failed(false) {}
+  ~IndexReader() { Close(); }
+  IndexReader(const IndexReader&) = delete;
+  IndexReader& operator = (const IndexReader&) = delete;
+
+  bool Open(const string& fileName);  // Map the file read-only and check the header
+  void Close();                       // Arrays mapped from the file become invalid
+  bool Failed() const { return m_failed; } // Whether a read ran past the end of the file
+
+  int64_t ReadInt();
+  double ReadFloat();
+  string ReadString();
+  template<class T> const T* ReadArray(int64_t& count) { return (const T*)ReadArrayBytes(count, sizeof(T)); }
+  template<class T> void ReadArray(svec<T>& values) { // Copy a (small) array out of the mapping
+    int64_t count;
+    const T* data = ReadArray<T>(count);
+    values.assign(data, data+count);
+  }
+  template<class T> void ReadArray(FlatArray<T>& values) { // Refer to an array inside the mapping
+    int64_t count;
+    const T* data = ReadArray<T>(count);
+    values.Map(data, count);
+  }
+
+private:
+  const char* Read(int64_t bytes);
+  const char* ReadArrayBytes(int64_t& count, int elemSize);
+
+  char* m_map;      /// Mapped file contents
+  int64_t m_size;   /// Size of the mapped file
+  int64_t m_pos;    /// Read position
+  bool m_failed;    /// Whether a read has run past the end of the file
+};
+
+#endif //INDEXFILE_H
@@ -0,0 +1,163 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <string.h>
+#include <math.h>
+#include "ryggrad/src/base/Logger.h"
+#include "MatchWriter.h"
+
+void OutputBuffer::Append(const char* str) {
+  m_data.insert(m_data.end(), str, str+strlen(str));
+}
+
+void OutputBuffer::Append(int64_t value) {
+  char digits[24];
+  int pos = sizeof(digits);
+  uint64_t absValue = (value < 0? -(uint64_t)value: value);
+  do {
+    digits[--pos] = '0' + absValue%10;
+    absValue     /= 10;
+  } while(absValue > 0);
+  if(value < 0) { digits[--pos] = '-'; }
+  m_data.insert(m_data.end(), digits+pos, digits+sizeof(digits));
+}
+
+void OutputBuffer::Append(float value) {
+  // Scores nearly always lie in [0.1, 1), where six significant digits are six decimals less any trailing zeros
+  if(value >= 0.1f && value < 1.0f) {
+    int64_t scaled = llrint((double)value * 1e6);
+    if(scaled < 1000000) {
+      char digits[8] = {'0', '.'};
+      int len = 2;
+      for(int64_t div=100000; div>0; div/=10) { digits[len++] = '0' + (scaled/div)%10; }
+      while(digits[len-1] == '0') { len--; }
+      m_data.insert(m_data.end(), digits, digits+len);
+      return;
+    }
+  }
+  char text[32];
+  int len = snprintf(text, sizeof(text), "%g", value);
+  m_data.insert(m_data.end(), text, text+len);
+}
+
+bool MatchWriter::Open(const string& fileName, bool binary) {
+  Close();
+  if(fileName == "" || fileName == "-") {
+    m_file    = stdout;
+    m_ownFile = false;
+  } else {
+    m_file = fopen(fileName.c_str(), "w");
+    if(m_file == NULL) {
+      FILE_LOG(logERROR) << "Could not create output file: " << fileName;
+      return false;
+    }
+    m_ownFile = true;
+  }
+  m_pending.reserve(s_blockSize);
+  m_binary  = binary;
+  m_busy    = false;
+  m_closing = false;
+  m_failed  = false;
+  m_bytes   = 0;
+  m_names.clear();
+  m_nameStarts.assign(1, 0);
+  if(m_binary) {
+    int32_t header[2] = {OverlapFile::s_version, (int32_t)sizeof(OverlapRecord)};
+    if(fwrite(OverlapFile::Magic(), 1, 8, m_file) != 8 || fwrite(header, sizeof(header), 1, m_file) != 1) { m_failed = true; }
+  }
+  m_thread  = std::thread(&MatchWriter::WriteBlocks, this);
+  return true;
+}
+
+bool MatchWriter::Close() {
+  if(m_file == NULL) { return !m_failed; }
+  QueuePending();
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closing = true;
+  }
+  m_queued.notify_one();
+  m_thread.join();
+  if(m_binary) {
+    // The name table follows the records on an 8 byte boundary, the trailer locates both
+    static const char padding[8] = {0};
+    int64_t recordBytes = m_bytes;
+    int64_t padBytes    = (8 - recordBytes%8) % 8;
+    int64_t trailer[3]  = {recordBytes/(int64_t)sizeof(OverlapRecord), OverlapFile::s_headerSize+recordBytes+padBytes, m_nameStarts.isize()-1};
+    if(fwrite(padding, 1, padBytes, m_file) != (size_t)padBytes
+       || fwrite(m_nameStarts.data(), sizeof(int64_t), m_nameStarts.size(), m_file) != m_nameStarts.size()
+       || fwrite(m_names.data(), 1, m_names.size(), m_file) != m_names.size()
+       || fwrite(padding, 1, (8-m_names.size()%8)%8, m_file) != (8-m_names.size()%8)%8
+       || fwrite(trailer, sizeof(trailer), 1, m_file) != 1 || fwrite(OverlapFile::Magic(), 1, 8, m_file) != 8) { 
+      m_failed = true; 
+    }
+    string().swap(m_names);
+    svec<int64_t>().swap(m_nameStarts);
+  }
+  if(fflush(m_file) != 0) { m_failed = true; }
+  if(m_ownFile && fclose(m_file) != 0) { m_failed = true; }
+  m_file = NULL;
+  m_free.clear();
+  svec<char>().swap(m_pending);
+  if(m_failed) { FILE_LOG(logERROR) << "Failed writing the mapping output"; }
+  return !m_failed;
+}
+
+int MatchWriter::AddName(const string& name) {
+  m_names += name;
+  m_nameStarts.push_back(m_names.size());
+  return m_nameStarts.isize()-2;
+}
+
+void MatchWriter::Write(OutputBuffer& buffer) {
+  m_pending.insert(m_pending.end(), buffer.Data(), buffer.Data()+buffer.Size());
+  m_bytes += buffer.Size();
+  buffer.Clear();
+  if(m_pending.isize() >= s_blockSize) { QueuePending(); }
+}
+
+void MatchWriter::Flush() {
+  if(m_file == NULL) { return; }
+  QueuePending();
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_written.wait(lock, [this] { return m_queue.empty() && !m_busy; });
+  if(fflush(m_file) != 0) { m_failed = true; }
+}
+
+void MatchWriter::QueuePending() {
+  if(m_pending.empty()) { return; }
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_written.wait(lock, [this] { return (int)m_queue.size() < s_maxQueued; });
+    m_queue.push_back(svec<char>());
+    m_queue.back().swap(m_pending);
+    if(!m_free.empty()) {
+      m_pending.swap(m_free.back());
+      m_free.pop_back();
+    }
+  }
+  m_queued.notify_one();
+  m_pending.clear();
+  m_pending.reserve(s_blockSize);
+}
+
+void MatchWriter::WriteBlocks() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while(true) {
+    m_queued.wait(lock, [this] { return !m_queue.empty() || m_closing; });
+    if(m_queue.empty()) { return; } // Closing
+    svec<char> block;
+    block.swap(m_queue.front());
+    m_queue.pop_front();
+    m_busy = true;
+    lock.unlock();
+    if(fwrite(block.data(), 1, block.size(), m_file) != block.size()) { m_failed = true; }
+    block.clear();
+    lock.lock();
+    m_free.push_back(svec<char>());
+    m_free.back().swap(block);
+    m_busy = false;
+    m_written.notify_all();
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef MATCHWRITER_H
+#define MATCHWRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "ryggrad/src/base/SVector.h"
+#include "OverlapFile.h"
+
+/* Text being formatted by one thread, with number conversions that avoid streams and locale handling */
+class OutputBuffer
+{
+public:
+  OutputBuffer(int reserve=1<<16): m_data() { m_data.reserve(reserve); }
+
+  int64_t Size() const             { return m_data.size();  }
+  const char* Data() const         { return m_data.data();  }
+  void Clear()                     { m_data.clear();        }
+
+  void Append(char c)              { m_data.push_back(c);   }
+  void Append(const string& str)   { m_data.insert(m_data.end(), str.begin(), str.end()); }
+  void Append(const char* str);
+  void Append(int64_t value);
+  void Append(int value)           { Append((int64_t)value); }
+  void Append(float value);        // Same text as printing with the default stream precision (%g)
+  void Append(const OverlapRecord& record) { m_data.insert(m_data.end(), (const char*)&record, (const char*)(&record+1)); }
+
+private:
+  svec<char> m_data;  /// Formatted text
+};
+
+/* Writes the output of the mapping threads to a file or standard output from a thread of its own.
+ * Output handed over with Write is gathered into large blocks, which are queued for the writer thread,
+ * so mapping threads neither flush nor wait on the output unless the queue is full.
+ * The output is either PAF text or binary overlap records (see OverlapFile), whose name table is written on closing. */
+class MatchWriter
+{
+public:
+  MatchWriter(): m_file(NULL), m_ownFile(false), m_binary(false), m_names(), m_nameStarts(), m_pending(), m_queue(), m_free(), 
+                 m_busy(false), m_closing(false), m_failed(false), m_bytes(0) {}
+  ~MatchWriter() { Close(); }
+  MatchWriter(const MatchWriter&) = delete;
+  MatchWriter& operator = (const MatchWriter&) = delete;
+
+  bool Open(const string& fileName, bool binary); // Empty or "-" for standard output
+  bool Close();                      // Write out everything and stop the writer thread, false if anything could not be written
+  bool IsOpen() const   { return m_file != NULL; }
+  bool IsBinary() const { return m_binary;       }
+  int AddName(const string& name);   // Add a sequence name to the binary name table, returns its index
+  int NumNames() const { return m_nameStarts.isize()-1; }
+  void Write(OutputBuffer& buffer);  // Append the buffer's text to the output and clear the buffer (one caller at a time)
+  void Flush();                      // Wait until everything handed over so far has been written
+  int64_t BytesWritten() const { return m_bytes; }
+
+private:
+  static const int s_blockSize  = 1<<22;  // Size of the blocks handed to the writer thread
+  static const int s_maxQueued  = 4;      // Blocks that may wait for the writer thread before Write blocks
+
+  void QueuePending();
+  void WriteBlocks();                     // Body of the writer thread
+
+  FILE* m_file;                       /// Output file
+  bool m_ownFile;                     /// Whether the output file has to be closed (i.e. it is not standard output)
+  bool m_binary;                      /// Whether binary overlap records are written instead of PAF text
+  string m_names;                     /// Characters of the sequence names in the binary name table
+  svec<int64_t> m_nameStarts;         /// Offsets of the names in the binary name table (one extra entry marking the end)
+  svec<char> m_pending;               /// Block being filled
+  std::deque<svec<char> > m_queue;    /// Blocks waiting to be written
+  svec<svec<char> > m_free;           /// Written blocks kept for reuse
+  bool m_busy;                        /// Whether the writer thread is writing a block
+  bool m_closing;                     /// Whether the writer thread should stop once the queue is empty
+  bool m_failed;                      /// Whether a write has failed
+  int64_t m_bytes;                    /// Bytes handed over so far
+  std::mutex m_mutex;
+  std::condition_variable m_queued;   /// Signalled when a block is queued or the writer is closing
+  std::condition_variable m_written;  /// Signalled when a block has been written
+  std::thread m_thread;
+};
+
+#endif //MATCHWRITER_H
@@ -0,0 +1,137 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <climits>
+#include <algorithm>
+#include "MatchedPairs.h"
+
+const uint64_t MatchedPairs::s_emptyKey;
+
+MatchedPairs::MatchedPairs(int numStripes): m_numStripes(numStripes), m_stripes(new Stripe[numStripes]) {}
+
+bool MatchedPairs::IsMatched(int seq1, int seq2, uint64_t searchOrder) const {
+  return GetSearchOrder(seq1, seq2) <= searchOrder;
+}
+
+uint64_t MatchedPairs::GetSearchOrder(int seq1, int seq2) const {
+  uint64_t key  = PairKey(seq1, seq2);
+  uint64_t hash = Hash(key);
+  const Stripe& stripe = m_stripes[StripeIdx(hash)];
+  uint64_t searchOrder = UINT64_MAX;
+  stripe.Lock();
+  int slot = stripe.FindSlot(key, hash);
+  if(slot >= 0 && stripe.m_keys[slot] == key) { searchOrder = stripe.m_orders[slot]; }
+  stripe.Unlock();
+  return searchOrder;
+}
+
+void MatchedPairs::SetMatched(int seq1, int seq2, uint64_t searchOrder) {
+  uint64_t key  = PairKey(seq1, seq2);
+  uint64_t hash = Hash(key);
+  Stripe& stripe = m_stripes[StripeIdx(hash)];
+  stripe.Lock();
+  stripe.Insert(key, hash, searchOrder);
+  stripe.Unlock();
+}
+
+void MatchedPairs::Seal() {
+  for(int sIdx=0; sIdx<m_numStripes; sIdx++) {
+    Stripe& stripe = m_stripes[sIdx];
+    stripe.Lock();
+    for(int slot=0; slot<stripe.m_keys.isize(); slot++) {
+      if(stripe.m_keys[slot] != s_emptyKey) { stripe.m_orders[slot] = 0; }
+    }
+    stripe.Unlock();
+  }
+}
+
+int64_t MatchedPairs::NumPairs() const {
+  int64_t total = 0;
+  for(int sIdx=0; sIdx<m_numStripes; sIdx++) {
+    total += m_stripes[sIdx].m_count;
+  }
+  return total;
+}
+
+int64_t MatchedPairs::MemoryBytes() const {
+  int64_t total = (int64_t)m_numStripes * sizeof(Stripe);
+  for(int sIdx=0; sIdx<m_numStripes; sIdx++) {
+    total += m_stripes[sIdx].m_keys.capacity() * sizeof(uint64_t) + m_stripes[sIdx].m_orders.capacity() * sizeof(uint64_t);
+  }
+  return total;
+}
+
+int MatchedPairs::Stripe::FindSlot(uint64_t key, uint64_t hash) const {
+  if(m_keys.empty()) { return -1; }
+  int mask = m_keys.isize() - 1;
+  int slot = hash & mask;
+  while(m_keys[slot] != key && m_keys[slot] != s_emptyKey) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void MatchedPairs::Stripe::Insert(uint64_t key, uint64_t hash, uint64_t searchOrder) {
+  if(2*(m_count+1) > m_keys.isize()) { Grow(); } // Keep the load factor at or below 0.5
+  int slot = FindSlot(key, hash);
+  if(m_keys[slot] == s_emptyKey) {
+    m_keys[slot]   = key;
+    m_orders[slot] = searchOrder;
+    m_count++;
+  } else if(searchOrder < m_orders[slot]) {
+    m_orders[slot] = searchOrder; // Keep the earliest
+  }
+}
+
+void MatchedPairs::Stripe::Grow() {
+  svec<uint64_t> oldKeys, oldOrders;
+  oldKeys.swap(m_keys);
+  oldOrders.swap(m_orders);
+  int newSize = (oldKeys.empty()? 16: 2*oldKeys.isize());
+  m_keys.resize(newSize, s_emptyKey);
+  m_orders.resize(newSize, 0);
+  for(int slot=0; slot<oldKeys.isize(); slot++) {
+    if(oldKeys[slot] == s_emptyKey) { continue; }
+    int newSlot = FindSlot(oldKeys[slot], Hash(oldKeys[slot]));
+    m_keys[newSlot]   = oldKeys[slot];
+    m_orders[newSlot] = oldOrders[slot];
+  }
+}
+
+ValidationMemo::ValidationMemo(int logSize): m_mask((1<<logSize)-1), m_pairs(), m_buckets(), m_generations(), m_generation(0) {
+  m_pairs.resize(m_mask+1, UINT64_MAX);
+  m_buckets.resize(m_mask+1, 0);
+  m_generations.resize(m_mask+1, 0);
+}
+
+void ValidationMemo::Clear() {
+  m_generation++;
+  if(m_generation == INT_MAX) {
+    // Wrapping around would bring back stale entries, so really clear the table once in a long while
+    fill(m_pairs.begin(), m_pairs.end(), UINT64_MAX);
+    fill(m_generations.begin(), m_generations.end(), 0);
+    m_generation = 0;
+  }
+}
+
+int ValidationMemo::Slot(int& seq1, int& seq2, int& bucket) const {
+  if(seq1 > seq2) {
+    swap(seq1, seq2);
+    bucket = -bucket;
+  }
+  bucket >>= s_bucketShift;
+  return MatchedPairs::Hash(MatchedPairs::PairKey(seq1, seq2) + (uint64_t)(uint32_t)bucket*0x9e3779b97f4a7c15ULL) & m_mask;
+}
+
+bool ValidationMemo::IsRejected(int seq1, int seq2, int diagonal) const {
+  int slot = Slot(seq1, seq2, diagonal);
+  return m_generations[slot] == m_generation && m_pairs[slot] == MatchedPairs::PairKey(seq1, seq2) && m_buckets[slot] == diagonal;
+}
+
+void ValidationMemo::SetRejected(int seq1, int seq2, int diagonal) {
+  int slot = Slot(seq1, seq2, diagonal);
+  m_pairs[slot]   = MatchedPairs::PairKey(seq1, seq2);
+  m_buckets[slot] = diagonal;
+  m_generations[slot] = m_generation;
+}
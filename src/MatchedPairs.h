@@ -0,0 +1,118 @@
+#ifndef MATCHEDPAIRS_H
+#define MATCHEDPAIRS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include "DPMatcher.h"
+
+class MatchRecord
+{
+public:
+  MatchRecord(): m_seq1(-1), m_pos1(-1), m_seq2(-1), m_pos2(-1), m_matchInfo(), m_searchOrder(0), m_rank(0) {}
+  MatchRecord(const Dmer& dm1, const Dmer& dm2, const MatchInfo& mInfo, uint64_t searchOrder, int rank)
+             : m_seq1(dm1.Seq()), m_pos1(dm1.Pos()), m_seq2(dm2.Seq()), m_pos2(dm2.Pos()),
+               m_matchInfo(mInfo), m_searchOrder(searchOrder), m_rank(rank) {}
+
+  int Seq1() const                   { return m_seq1;        }
+  int Pos1() const                   { return m_pos1;        }
+  int Seq2() const                   { return m_seq2;        }
+  int Pos2() const                   { return m_pos2;        }
+  const MatchInfo& GetMatchInfo() const { return m_matchInfo; }
+  uint64_t SearchOrder() const       { return m_searchOrder; }
+
+  inline bool operator < (const MatchRecord& rhs) const {
+    return(tie(m_searchOrder, m_rank) < tie(rhs.m_searchOrder, rhs.m_rank));
+  }
+
+private:
+  int m_seq1;             /// Read index of the first dmer (the dmer being searched for)
+  int m_pos1;             /// Offset of the first dmer in its read
+  int m_seq2;             /// Read index of the second dmer (the dmer found in the neighbouring cells)
+  int m_pos2;             /// Offset of the second dmer in its read
+  MatchInfo m_matchInfo;  /// Result of the refinement stage
+  uint64_t m_searchOrder; /// Position of the first dmer in the serial search order (see MatchedPairs::SearchOrder)
+  int m_rank;             /// Order of acceptance amongst matches sharing the same search order
+};
+
+/* Thread-safe flagset of read pairs that have already been matched.
+ * Every pair remembers the earliest position in the serial search order at which it was accepted, so that
+ * a parallel search can reproduce exactly the matches a serial search would report.
+ * Pairs are kept as 64-bit keys in open-addressing hash tables, partitioned into independently locked stripes. */
+class MatchedPairs
+{
+public:
+  MatchedPairs(int numStripes=1024);
+
+  /* Position of a dmer in the serial search order (cell by cell, dmer by dmer) - 0 is reserved for sealed pairs */
+  static uint64_t SearchOrder(int cellIdx, int dmerIdx) { return ((uint64_t)(cellIdx+1)<<32) | (uint32_t)dmerIdx; }
+
+  bool IsMatched(int seq1, int seq2, uint64_t searchOrder) const; // Whether the pair has been accepted at or before the given search order
+  uint64_t GetSearchOrder(int seq1, int seq2) const;              // Earliest search order the pair has been accepted at (UINT64_MAX if never)
+  void SetMatched(int seq1, int seq2, uint64_t searchOrder);
+  void Seal();  // Mark all pairs matched so far as preceding any further search (i.e. when moving on to the next motif)
+  int64_t NumPairs() const;
+  int64_t MemoryBytes() const;  // Memory footprint of the hash tables
+
+  static uint64_t PairKey(int seq1, int seq2) { return ((uint64_t)(uint32_t)seq1<<32) | (uint32_t)seq2; }
+  static uint64_t Hash(uint64_t key) {  // 64-bit finaliser from MurmurHash3
+    key ^= key >> 33; key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33; key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+private:
+  static const uint64_t s_emptyKey = UINT64_MAX;  // (-1, -1) is never a valid pair
+
+  class Stripe {
+  public:
+    Stripe(): m_keys(), m_orders(), m_count(0) { m_lock.clear(); }
+
+    void Lock() const   { while(m_lock.test_and_set(std::memory_order_acquire)) {} }
+    void Unlock() const { m_lock.clear(std::memory_order_release); }
+    int FindSlot(uint64_t key, uint64_t hash) const; // Slot holding the key or the empty slot where it belongs (-1 if table is empty)
+    void Insert(uint64_t key, uint64_t hash, uint64_t searchOrder);
+
+    svec<uint64_t> m_keys;       /// Pair keys, s_emptyKey marks a free slot (linear probing, power of two capacity)
+    svec<uint64_t> m_orders;     /// Earliest search order per key
+    int m_count;                 /// Number of occupied slots
+  private:
+    void Grow();
+    mutable std::atomic_flag m_lock;
+    char m_padding[64];          /// Keep stripes that are locked by different threads on separate cache lines
+  };
+
+  int StripeIdx(uint64_t hash) const { return (hash >> 40) % m_numStripes; }
+
+  int m_numStripes;                     /// Number of independently locked partitions of the pair set
+  std::unique_ptr<Stripe[]> m_stripes;  /// Partitions of the pair set selected by key hash
+};
+
+/* Bounded memo of read pairs rejected at validation, by diagonal (difference of the dmer offsets). Seeds of a rejected pair on
+ * nearly the same diagonal walk mostly the same sites, so they are not validated again, while seeds on other diagonals
+ * (e.g. repeats) still are. Entries live in a direct mapped table where a new entry replaces the one sharing its slot.
+ * Not thread-safe, every thread keeps a memo of its own. The memo only lasts for one search unit (a cell, a read or a query) that a
+ * single thread handles in order, so that what it skips does not depend on the units the same thread handled before. */
+class ValidationMemo
+{
+public:
+  ValidationMemo(int logSize=16);
+
+  bool IsRejected(int seq1, int seq2, int diagonal) const;
+  void SetRejected(int seq1, int seq2, int diagonal);
+  void Clear();  // Forget all entries (a new generation of the table, without touching it)
+
+private:
+  static const int s_bucketShift = 2;  // Diagonals are bucketed by 4 sites, absorbing a few missing or extra sites
+
+  int Slot(int& seq1, int& seq2, int& bucket) const; // Orders the pair (either read may be searched for first) and finds its slot
+
+  int m_mask;               /// Table size less one (power of two)
+  svec<uint64_t> m_pairs;   /// Pair key per slot (see MatchedPairs::PairKey), UINT64_MAX marks a free slot
+  svec<int> m_buckets;      /// Diagonal bucket per slot
+  svec<int> m_generations;  /// Generation each slot was written in, entries of earlier generations are stale
+  int m_generation;         /// Current generation
+};
+
+#endif //MATCHEDPAIRS_H
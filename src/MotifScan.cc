@@ -0,0 +1,118 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <stdint.h>
+#include "MotifScan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOTIFSCAN_X86
+#include <immintrin.h>
+#endif
+
+static const char s_caseFold = (char)0xDF; // Clears the lower case bit of letters
+
+void MotifScan::FindScalar(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  for (int p=0; p<count; p++) {
+    int j = 0;
+    for (j=0; j<motifLen; j++) {
+      if ((bases[p+j] & s_caseFold) != (motif[j] & s_caseFold))
+        break;
+    }
+    if (j == motifLen) {
+      sites.push_back(offset+p);
+    }
+  }
+}
+
+#ifdef MOTIFSCAN_X86
+
+// Each block compares the first motif base at every position, then ANDs in the compares of the following bases shifted along
+
+void MotifScan::FindSSE(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  __m128i fold = _mm_set1_epi8(s_caseFold);
+  for (int p=0; p<count; p+=16) {
+    uint32_t mask = 0xFFFF;
+    for (int j=0; j<motifLen && mask; j++) {
+      __m128i block = _mm_and_si128(_mm_loadu_si128((const __m128i*)(bases+p+j)), fold);
+      mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(motif[j] & s_caseFold)));
+    }
+    if (count-p < 16) { mask &= (1u << (count-p)) - 1; }
+    for (; mask; mask&=mask-1) {
+      sites.push_back(offset + p + __builtin_ctz(mask));
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+void MotifScan::FindAVX2(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  __m256i fold = _mm256_set1_epi8(s_caseFold);
+  for (int p=0; p<count; p+=32) {
+    uint32_t mask = 0xFFFFFFFF;
+    for (int j=0; j<motifLen && mask; j++) {
+      __m256i block = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(bases+p+j)), fold);
+      mask &= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(motif[j] & s_caseFold)));
+    }
+    if (count-p < 32) { mask &= (1u << (count-p)) - 1; }
+    for (; mask; mask&=mask-1) {
+      sites.push_back(offset + p + __builtin_ctz(mask));
+    }
+  }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void MotifScan::FindAVX512(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  __m512i fold = _mm512_set1_epi8(s_caseFold);
+  for (int p=0; p<count; p+=64) {
+    uint64_t mask = UINT64_MAX;
+    for (int j=0; j<motifLen && mask; j++) {
+      __m512i block = _mm512_and_si512(_mm512_loadu_si512((const void*)(bases+p+j)), fold);
+      mask &= _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8(motif[j] & s_caseFold));
+    }
+    if (count-p < 64) { mask &= ((uint64_t)1 << (count-p)) - 1; }
+    for (; mask; mask&=mask-1) {
+      sites.push_back(offset + p + __builtin_ctzll(mask));
+    }
+  }
+}
+
+#else
+
+void MotifScan::FindSSE(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  FindScalar(bases, count, motif, motifLen, offset, sites);
+}
+
+void MotifScan::FindAVX2(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  FindScalar(bases, count, motif, motifLen, offset, sites);
+}
+
+void MotifScan::FindAVX512(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites) {
+  FindScalar(bases, count, motif, motifLen, offset, sites);
+}
+
+#endif //MOTIFSCAN_X86
+
+static MotifScan::FindFunc SelectFind() {
+#ifdef MOTIFSCAN_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512bw")) { return MotifScan::FindAVX512; }
+  if(__builtin_cpu_supports("avx2"))     { return MotifScan::FindAVX2;   }
+  return MotifScan::FindSSE;
+#else
+  return MotifScan::FindScalar;
+#endif
+}
+
+MotifScan::FindFunc MotifScan::Best() {
+  static const FindFunc best = SelectFind();
+  return best;
+}
+
+const char* MotifScan::Name(FindFunc func) {
+#ifdef MOTIFSCAN_X86
+  if(func == FindAVX512) { return "AVX-512"; }
+  if(func == FindAVX2)   { return "AVX2";    }
+  if(func == FindSSE)    { return "SSE2";    }
+#endif
+  return "scalar";
+}
@@ -0,0 +1,25 @@
+#ifndef MOTIFSCAN_H
+#define MOTIFSCAN_H
+
+#include "ryggrad/src/base/SVector.h"
+
+/* Vectorised search for the occurrences of a motif in a stretch of bases (either case).
+ * Every kernel tests the start positions 0..count-1 and appends offset+position for each occurrence to sites.
+ * The bases must be readable for BasePadding bytes beyond the last motif tested. */
+class MotifScan
+{
+public:
+  static const int BasePadding = 64;  /// Bytes the kernels may read past count+motifLen-1
+
+  typedef void (*FindFunc)(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites);
+
+  static void FindScalar(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites);
+  static void FindSSE(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites);
+  static void FindAVX2(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites);
+  static void FindAVX512(const char* bases, int count, const char* motif, int motifLen, int offset, svec<int>& sites);
+
+  static FindFunc Best();                 // Widest kernel the CPU supports (selected once at runtime)
+  static const char* Name(FindFunc func); // Name of the kernel for logging
+};
+
+#endif //MOTIFSCAN_H
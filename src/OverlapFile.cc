@@ -0,0 +1,124 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ryggrad/src/base/Logger.h"
+#include "OverlapFile.h"
+#include "MatchWriter.h"
+
+void OverlapRecord::AppendPAF(const string& queryName, const string& targetName, OutputBuffer& out) const {
+  char delim = '\t';
+  out.Append(queryName);        out.Append(delim);
+  out.Append(m_queryLen);       out.Append(delim);
+  out.Append(m_queryStart);     out.Append(delim);
+  out.Append(m_queryEnd);       out.Append(delim);
+  out.Append(m_strand>0? '+': '-'); out.Append(delim);
+  out.Append(targetName);       out.Append(delim);
+  out.Append(m_targetLen);      out.Append(delim);
+  out.Append(m_targetStart);    out.Append(delim);
+  out.Append(m_targetEnd);      out.Append(delim);
+  out.Append(m_score);          out.Append(delim);
+  out.Append(AlignBlockLen());  out.Append(delim);
+  out.Append(255);              out.Append(delim); // Mapping quality is not available
+  //Auxillary info:
+  out.Append("queryPreDist:");   out.Append(m_queryPreDist);   out.Append(delim);
+  out.Append("queryPostDist:");  out.Append(m_queryPostDist);  out.Append(delim);
+  out.Append("targetPreDist:");  out.Append(m_targetPreDist);  out.Append(delim);
+  out.Append("targetPostDist:"); out.Append(m_targetPostDist);
+  out.Append('\n');
+}
+
+OverlapRecord OverlapRecord::Swapped() const {
+  OverlapRecord swapped = *this;
+  swap(swapped.m_querySeq, swapped.m_targetSeq);
+  swap(swapped.m_queryLen, swapped.m_targetLen);
+  swap(swapped.m_queryStart, swapped.m_targetStart);
+  swap(swapped.m_queryEnd, swapped.m_targetEnd);
+  swap(swapped.m_queryPreDist, swapped.m_targetPreDist);
+  swap(swapped.m_queryPostDist, swapped.m_targetPostDist);
+  return swapped;
+}
+
+OverlapRecord OverlapRecord::Mirrored() const {
+  // Positions are counted from the other end, which exchanges the first and last positions of either sequence
+  OverlapRecord mirrored  = *this;
+  mirrored.m_queryStart     = m_queryLen - m_queryEnd;
+  mirrored.m_queryEnd       = m_queryLen - m_queryStart;
+  mirrored.m_queryPreDist   = m_queryLen - m_queryPostDist;
+  mirrored.m_queryPostDist  = m_queryLen - m_queryPreDist;
+  mirrored.m_targetStart    = m_targetLen - m_targetEnd;
+  mirrored.m_targetEnd      = m_targetLen - m_targetStart;
+  mirrored.m_targetPreDist  = m_targetLen - m_targetPostDist;
+  mirrored.m_targetPostDist = m_targetLen - m_targetPreDist;
+  return mirrored;
+}
+
+bool OverlapReader::Open(const string& fileName) {
+  Close();
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if(fd < 0) {
+    FILE_LOG(logERROR) << "Could not open overlap file: " << fileName;
+    return false;
+  }
+  struct stat fileStat;
+  if(fstat(fd, &fileStat) == 0 && fileStat.st_size >= OverlapFile::s_headerSize+OverlapFile::s_trailerSize) {
+    void* map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED) {
+      m_map  = (char*)map;
+      m_size = fileStat.st_size;
+    }
+  }
+  close(fd);
+  if(m_map == NULL) {
+    FILE_LOG(logERROR) << "Could not map overlap file: " << fileName;
+    return false;
+  }
+  int32_t version, recordSize;
+  int64_t trailer[3];
+  memcpy(&version, m_map+8, sizeof(version));
+  memcpy(&recordSize, m_map+12, sizeof(recordSize));
+  memcpy(trailer, m_map+m_size-OverlapFile::s_trailerSize, sizeof(trailer));
+  int64_t numRecords = trailer[0], namesOffset = trailer[1], numNames = trailer[2];
+  int64_t namesEnd   = m_size - OverlapFile::s_trailerSize;
+  // Counts are bounded by the file size before multiplying, which could wrap around
+  bool valid = (memcmp(m_map, OverlapFile::Magic(), 8) == 0 && memcmp(m_map+namesEnd+24, OverlapFile::Magic(), 8) == 0
+                && version == OverlapFile::s_version && recordSize == sizeof(OverlapRecord) && numRecords >= 0 && numNames >= 0
+                && numRecords <= (namesEnd-OverlapFile::s_headerSize)/(int64_t)sizeof(OverlapRecord));
+  int64_t recordBytes = (valid? numRecords*(int64_t)sizeof(OverlapRecord): 0);
+  valid = (valid && namesOffset == OverlapFile::s_headerSize + recordBytes + (8-recordBytes%8)%8
+           && namesOffset <= namesEnd && numNames < (namesEnd-namesOffset)/8);
+  if(valid) {
+    m_records    = (const OverlapRecord*)(m_map + OverlapFile::s_headerSize);
+    m_numRecords = numRecords;
+    m_nameStarts = (const int64_t*)(m_map + namesOffset);
+    m_names      = m_map + namesOffset + (numNames+1)*8;
+    m_numNames   = numNames;
+    valid = (m_nameStarts[0] == 0 && m_nameStarts[numNames] <= namesEnd-(m_names-m_map));
+    for(int64_t i=0; valid && i<numNames; i++) { valid = (m_nameStarts[i] <= m_nameStarts[i+1]); }
+    for(int64_t i=0; valid && i<numRecords; i++) {
+      valid = (m_records[i].m_querySeq >= 0 && m_records[i].m_querySeq < numNames && m_records[i].m_targetSeq >= 0 && m_records[i].m_targetSeq < numNames);
+    }
+  }
+  if(!valid) {
+    FILE_LOG(logERROR) << "Not a valid overlap file: " << fileName;
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void OverlapReader::Close() {
+  if(m_map != NULL) { munmap(m_map, m_size); }
+  m_map        = NULL;
+  m_size       = 0;
+  m_records    = NULL;
+  m_numRecords = 0;
+  m_nameStarts = NULL;
+  m_names      = NULL;
+  m_numNames   = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef OVERLAPFILE_H
+#define OVERLAPFILE_H
+
+#include <stdint.h>
+#include <string>
+#include "ryggrad/src/base/SVector.h"
+
+class OutputBuffer;
+
+/* One match in the binary overlap format: the fields of a PAF line with the names replaced by sequence indices */
+struct OverlapRecord
+{
+  int32_t m_querySeq;        /// Index of the query name in the name table
+  int32_t m_targetSeq;       /// Index of the target name in the name table
+  int32_t m_queryLen;        /// Query length in bases
+  int32_t m_queryStart;      /// First base of the match in the query
+  int32_t m_queryEnd;        /// Last base of the match in the query
+  int32_t m_targetLen;       /// Target length in bases
+  int32_t m_targetStart;     /// First base of the match in the target
+  int32_t m_targetEnd;       /// Last base of the match in the target
+  int32_t m_queryPreDist;    /// Bases before the first restriction site of the query
+  int32_t m_queryPostDist;   /// Query length less the bases after its last restriction site
+  int32_t m_targetPreDist;   /// Bases before the first restriction site of the target
+  int32_t m_targetPostDist;  /// Target length less the bases after its last restriction site
+  float   m_score;           /// Identity score of the match
+  int8_t  m_strand;          /// Relative strand of the two sequences (+1 or -1)
+  int8_t  m_padding[3];
+
+  int AlignBlockLen() const { return max(m_queryEnd-m_queryStart, m_targetEnd-m_targetStart); }
+  OverlapRecord Swapped() const;   // Same match with query and target exchanged
+  OverlapRecord Mirrored() const;  // Same match on the reverse complements of both sequences
+  void AppendPAF(const string& queryName, const string& targetName, OutputBuffer& out) const; // Format as a PAF line
+};
+
+/* Binary overlap files start with a header, followed by fixed size records (so they can be used in place once mapped),
+ * the table of sequence names (offsets, then the characters) and a trailer that locates everything:
+ *   header:  magic (8 bytes), version (int32), record size (int32)
+ *   records: OverlapRecord * record count
+ *   names:   name count+1 offsets (int64, relative to the first character), characters (starting on an 8 byte boundary)
+ *   trailer: record count, offset of the name table, name count (int64 each), magic (8 bytes) */
+class OverlapFile
+{
+public:
+  static const char* Magic()          { return "SLAPSOVL"; }
+  static const int s_version    = 1;
+  static const int s_headerSize = 16;
+  static const int s_trailerSize = 32;
+};
+
+/* Memory-mapped binary overlap file */
+class OverlapReader
+{
+public:
+  OverlapReader(): m_map(NULL), m_size(0), m_records(NULL), m_numRecords(0), m_nameStarts(NULL), m_names(NULL), m_numNames(0) {}
+  ~OverlapReader() { Close(); }
+  OverlapReader(const OverlapReader&) = delete;
+  OverlapReader& operator = (const OverlapReader&) = delete;
+
+  bool Open(const string& fileName);
+  void Close();
+
+  int64_t NumRecords() const                   { return m_numRecords;  }
+  const OverlapRecord& Record(int64_t i) const { return m_records[i];  }
+  int64_t NumNames() const                     { return m_numNames;    }
+  string Name(int64_t i) const                 { return string(m_names+m_nameStarts[i], m_nameStarts[i+1]-m_nameStarts[i]); }
+
+private:
+  char* m_map;                    /// Mapped file contents
+  int64_t m_size;                 /// Size of the mapped file
+  const OverlapRecord* m_records; /// First record
+  int64_t m_numRecords;           /// Number of records
+  const int64_t* m_nameStarts;    /// Offsets of the names (one extra entry marking the end)
+  const char* m_names;            /// Characters of all names
+  int64_t m_numNames;             /// Number of names
+};
+
+#endif //OVERLAPFILE_H
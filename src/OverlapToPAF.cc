@@ -0,0 +1,47 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include "ryggrad/src/base/CommandLineParser.h"
+#include "ryggrad/src/base/Logger.h"
+#include "OverlapFile.h"
+#include "MatchWriter.h"
+
+
+int main( int argc, char** argv )
+{
+  commandArg<string> fileCmmd("-i","binary overlap file written by SiteLaps -f bin");
+  commandArg<string> outCmmd("-o","output PAF file (standard output if not given)", "");
+  commandLineParser P(argc,argv);
+  P.SetDescription("Convert binary overlap records to PAF.");
+  P.registerArg(fileCmmd);
+  P.registerArg(outCmmd);
+
+  P.parse();
+
+  string fileName = P.GetStringValueFor(fileCmmd);
+  string outFile  = P.GetStringValueFor(outCmmd);
+
+  OverlapReader reader;
+  if(!reader.Open(fileName)) {
+    cout << "Could not read overlap file: " << fileName << endl;
+    return 1;
+  }
+  MatchWriter writer;
+  if(!writer.Open(outFile, false)) {
+    cout << "Could not create output file: " << outFile << endl;
+    return 1;
+  }
+  // Names are looked up once, records refer to them by index
+  svec<string> names;
+  names.resize(reader.NumNames());
+  for(int64_t nameIdx=0; nameIdx<reader.NumNames(); nameIdx++) { names[nameIdx] = reader.Name(nameIdx); }
+  OutputBuffer out;
+  for(int64_t recIdx=0; recIdx<reader.NumRecords(); recIdx++) {
+    const OverlapRecord& record = reader.Record(recIdx);
+    record.AppendPAF(names[record.m_querySeq], names[record.m_targetSeq], out);
+    if(out.Size() >= (1<<16)) { writer.Write(out); }
+  }
+  writer.Write(out);
+  return (writer.Close()? 0: 1);
+}
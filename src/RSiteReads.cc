@@ -3,6 +3,7 @@
 #endif
 
 #include <sstream>
+#include "ryggrad/src/base/Logger.h"
 #include "RSiteReads.h"
 
 string RSiteRead::ToString() const {
@@ -11,66 +12,120 @@ string RSiteRead::ToString() const {
 string RSiteRead::ToString(int offset) const {
   stringstream ss;
   ss << PreDist() << ", ";
-  for (int i=offset; i<m_dist.isize(); i++) {
-    ss << m_dist[i] << ", ";
+  for (int i=offset; i<m_size; i++) {
+    ss << (*this)[i] << ", ";
   }
   ss << PostDist();
   return ss.str();
 }
 
-void RSiteRead::Flip() {
-  m_ori = -m_ori;
-  svec<int> tmp;
-  tmp.resize(m_dist.isize());
-  int k = m_dist.isize()-1;
-  for (int i=0; i<m_dist.isize(); i++) {
-    tmp[k] = m_dist[i];
-    k--;
+RSiteRead RSiteRead::Flipped() const {
+  // The constructor swaps pre/postfix for reversed views, so hand it those of the forward strand
+  return RSiteRead(m_cumDist, m_size, (m_reverse? m_postDist: m_preDist), (m_reverse? m_preDist: m_postDist), !m_reverse, m_name, m_nameLen);
+}
+
+SiteWalk RSiteRead::Walk(int offset, bool dir) const {
+  // Reverse complements are walked over the forward sums in the opposite direction
+  if(!m_reverse) { return (dir? SiteWalk(m_cumDist+offset, 1): SiteWalk(m_cumDist+offset+1, -1)); }
+  else           { return (dir? SiteWalk(m_cumDist+m_size-offset, -1): SiteWalk(m_cumDist+m_size-offset-1, 1)); }
+}
+
+void RSiteRead::GetDists(svec<int>& dists) const {
+  dists.resize(m_size);
+  for (int i=0; i<m_size; i++) {
+    dists[i] = (*this)[i];
   }
-  m_dist = tmp;
-  int tmp_pp; //Swap pre/postfix
-  tmp_pp     = m_preDist;
-  m_preDist  = m_postDist;
-  m_postDist = tmp_pp;
 }
 
-void RSiteRead::GetCumulative(RSiteRead& cRead, int offset, bool dir) const {
-  cRead.m_preDist  = m_preDist;
-  cRead.m_postDist = m_postDist;
-  cRead.m_name     = m_name;
-  cRead.m_ori      = m_ori;
-  
-  svec<int> tmp;
-  int readLen  = m_dist.isize();
-  tmp.resize(readLen);
-  int subreadLen = readLen - offset;
-  if(!dir) { subreadLen = offset; }
-  int acm      = 0; //Accumulation so far
-  for (int cnt=0; cnt<subreadLen; cnt++) {
-    if(dir) {
-      int addValue = m_dist[offset+cnt];
-      acm += addValue;
-      tmp[offset+cnt] = acm;
-    } else { 
-      int addValue = m_dist[offset-cnt]; 
-      acm += addValue;
-      tmp[offset-cnt] = acm;
+void RSiteReads::SetReverseComplements(bool withRC) {
+  m_withRC = withRC;
+}
+
+int64_t RSiteReads::MemoryBytes() const {
+  return m_cumDist.MemoryBytes() + m_seqStarts.MemoryBytes() + m_preDists.MemoryBytes() + m_postDists.MemoryBytes()
+         + m_nameStarts.MemoryBytes() + m_names.MemoryBytes();
+}
+
+RSiteRead RSiteReads::operator[](int idx) const {
+  int seqIdx   = idx/ReadsPerSequence();
+  int64_t from = m_seqStarts[seqIdx];
+  int64_t name = m_nameStarts[seqIdx];
+  return RSiteRead(m_cumDist.Data()+from, m_seqStarts[seqIdx+1]-from-1, m_preDists[seqIdx], m_postDists[seqIdx],
+                   IsReverse(idx), m_names.Data()+name, m_nameStarts[seqIdx+1]-name);
+}
+
+int RSiteReads::AddSequence(const string& name, const int* sitePos, int numSites, int preDist, int postDist) {
+  if(m_seqStarts.empty()) {
+    m_seqStarts.Append(0);
+    m_nameStarts.Append(0);
+  }
+  if(numSites > 0) {
+    for (int k=0; k<numSites; k++) {
+      m_cumDist.Append(sitePos[k]-sitePos[0]);
     }
+  } else {
+    m_cumDist.Append(0);
   }
-  cRead.m_dist = tmp;
+  m_seqStarts.Append(m_cumDist.Size());
+  m_preDists.Append(preDist);
+  m_postDists.Append(postDist);
+  m_names.Append(name.data(), name.data()+name.size());
+  m_nameStarts.Append(m_names.Size());
+  m_readCount += ReadsPerSequence();
+  return m_readCount-ReadsPerSequence();
 }
 
-int RSiteReads::AddRead(const RSiteRead& rr) {
-  m_rReads.push_back(rr);
-  m_readCount++;
-  return m_readCount-1;
+int RSiteReads::AddSequence(const RSiteReads& other, int seqIdx) {
+  int64_t from = other.m_seqStarts[seqIdx];
+  int64_t name = other.m_nameStarts[seqIdx];
+  return AddSequence(string(other.m_names.Data()+name, other.m_nameStarts[seqIdx+1]-name), other.m_cumDist.Data()+from,
+                     other.m_seqStarts[seqIdx+1]-from, other.m_preDists[seqIdx], other.m_postDists[seqIdx]);
 }
 
 string RSiteReads::ToString() const {
   string strOut;
   for(int i=0; i<m_readCount; i++) {
-    strOut += m_rReads[i].ToString();
+    strOut += (*this)[i].ToString();
     strOut += "\n";
   }
   return strOut;
 }
+
+void RSiteReads::WriteIndex(IndexWriter& writer) const {
+  // The columns are stored as they are, so that they can be mapped in place
+  writer.WriteInt(m_withRC);
+  writer.WriteInt(m_readCount);
+  writer.WriteArray(m_seqStarts);
+  writer.WriteArray(m_cumDist);
+  writer.WriteArray(m_preDists);
+  writer.WriteArray(m_postDists);
+  writer.WriteArray(m_nameStarts);
+  writer.WriteArray(m_names);
+}
+
+bool RSiteReads::LoadIndex(IndexReader& reader) {
+  m_withRC    = reader.ReadInt();
+  m_readCount = reader.ReadInt();
+  reader.ReadArray(m_seqStarts);
+  reader.ReadArray(m_cumDist);
+  reader.ReadArray(m_preDists);
+  reader.ReadArray(m_postDists);
+  reader.ReadArray(m_nameStarts);
+  reader.ReadArray(m_names);
+  int64_t numSeqs = m_preDists.Size();
+  bool valid = (!reader.Failed() && m_readCount == numSeqs*ReadsPerSequence() && m_postDists.Size() == numSeqs
+                && m_seqStarts.Size() == (numSeqs > 0? numSeqs+1: 0) && m_nameStarts.Size() == m_seqStarts.Size()
+                && (numSeqs == 0 || (m_seqStarts[0] == 0 && m_seqStarts[numSeqs] == m_cumDist.Size()
+                                     && m_nameStarts[0] == 0 && m_nameStarts[numSeqs] == m_names.Size())));
+  for(int64_t i=0; valid && i<numSeqs; i++) {
+    // Every sequence holds at least one prefix sum, starting at 0 and never decreasing (distances are not negative)
+    valid = (m_seqStarts[i] < m_seqStarts[i+1] && m_nameStarts[i] <= m_nameStarts[i+1] && m_cumDist[m_seqStarts[i]] == 0);
+    for(int64_t k=m_seqStarts[i]+1; valid && k<m_seqStarts[i+1]; k++) { valid = (m_cumDist[k-1] <= m_cumDist[k]); }
+  }
+  if(!valid) {
+    FILE_LOG(logERROR) << "Corrupt restriction site reads in index file";
+    *this = RSiteReads();
+    return false;
+  }
+  return true;
+}
@@ -2,58 +2,96 @@
 #define RSITEREADS_H
 
 #include "ryggrad/src/base/SVector.h"
+#include "IndexFile.h"
 
+/* Walk over the distances of a read starting at a site, forwards or backwards: for a pointer into the forward prefix sums and
+ * a stride of +1 or -1 the sum of the first k distances of the walk is stride*(cum[stride*k]-cum[0]), whatever the strand */
+class SiteWalk
+{
+public:
+  SiteWalk(const int* cum, int stride): m_cum(cum), m_stride(stride) {}
+
+  int Value(int idx) const         { return m_stride*(m_cum[m_stride*(idx+1)]-m_cum[m_stride*idx]); } // Distance at step idx
+  int Sum(int from, int to) const  { return m_stride*(m_cum[m_stride*to]-m_cum[m_stride*from]);     } // Sum of the distances in [from, to)
+  const int* At(int idx) const     { return m_cum + m_stride*idx; } // Prefix sum after idx steps (advance by Stride())
+  int Stride() const               { return m_stride; }
+
+private:
+  const int* m_cum;   /// Prefix sum at the start of the walk
+  int m_stride;       /// Direction of the walk over the prefix sums
+};
+
+/* Restriction site read: the distances between consecutive sites of a sequence for one motif.
+ * A read is a view into the storage of an RSiteReads object, which holds the prefix sums of the distances of the
+ * forward strand only; the reverse complement walks the same sums backwards. Views stay valid until sequences are added. */
 class RSiteRead
 {
 public:
-  RSiteRead() {
-    m_ori = 1;
-  }
-  
-  int operator[](int idx) const    { return m_dist[idx];    }
-  svec<int> & Dist()               { return m_dist;         }
-  string & Name()                  { return m_name;         }
-  int& PreDist()                   { return m_preDist;      }
-  int& PostDist()                  { return m_postDist;     }
-  int & Ori()                      { return m_ori;          }
-  const svec<int> & Dist() const   { return m_dist;         }
-  const int& PreDist() const       { return m_preDist;      }
-  const int& PostDist() const      { return m_postDist;     }
-  const string & Name() const      { return m_name;         }
-  const int & Ori() const          { return m_ori;          }
-  int Size() const                 { return m_dist.isize(); }
+  RSiteRead(): m_cumDist(NULL), m_size(0), m_preDist(0), m_postDist(0), m_reverse(false), m_name(NULL), m_nameLen(0) {}
+  RSiteRead(const int* cumDist, int size, int preDist, int postDist, bool reverse, const char* name, int nameLen)
+           : m_cumDist(cumDist), m_size(size), m_preDist(reverse? postDist: preDist), m_postDist(reverse? preDist: postDist),
+             m_reverse(reverse), m_name(name), m_nameLen(nameLen) {}
+
+  int operator[](int idx) const    { return (m_reverse? m_cumDist[m_size-idx]-m_cumDist[m_size-idx-1]: m_cumDist[idx+1]-m_cumDist[idx]); }
+  int CumDist(int count) const     { return (m_reverse? m_cumDist[m_size]-m_cumDist[m_size-count]: m_cumDist[count]); } // Sum of the first count distances
+  int DistSum(int from, int to) const { return (to <= from? 0: CumDist(to)-CumDist(from)); } // Sum of the distances in [from, to)
+  int PreDist() const              { return m_preDist;      }
+  int PostDist() const             { return m_postDist;     }
+  int Ori() const                  { return (m_reverse? -1: 1); }
+  string Name() const              { return string(m_name, m_nameLen); }
+  int Size() const                 { return m_size;         }
 
   string ToString() const;
   string ToString(int offset) const;
-  void Flip();
-  void GetCumulative(RSiteRead& cRead, int offset, bool dir) const;
+  RSiteRead Flipped() const;       // View of the other strand
+  SiteWalk Walk(int offset, bool dir) const; // Distances from offset on, towards the end (dir) or the start of the read
+  void GetDists(svec<int>& dists) const; // Copy out the distances
 
 private:
-  svec<int> m_dist;       /// Distmer values
+  const int* m_cumDist;   /// Prefix sums of the distmer values of the forward strand (m_size+1 values starting with 0)
+  int m_size;             /// Number of distmer values
   int m_preDist;          /// Number of bits prior to the start of the first distmer value
   int m_postDist;         /// Number of bits left over after the last distmer value
-  string m_name;          /// Name of optiRead
-  int m_ori;              /// Orientation
+  bool m_reverse;         /// Whether this is the reverse complement (orientation -1)
+  const char* m_name;     /// Name of optiRead
+  int m_nameLen;          /// Length of the name
 };
 
-class RSiteReads 
+/* Column store of restriction site reads: the prefix sums of the distances of all sequences back to back,
+ * followed by per sequence offsets, site prefix/postfix and a packed name arena.
+ * If reverse complements are included, read 2*s is the forward strand of sequence s and read 2*s+1 a reversed view of it.
+ * Arrays are either built by adding sequences or mapped in place from an index file. */
+class RSiteReads
 {
 public:
   // Default Ctor
-  RSiteReads(): m_readCount(0), m_rReads() {}
-
-  void Reserve(int size)                     { m_rReads.reserve(size);   }
+  RSiteReads(): m_withRC(false), m_readCount(0), m_cumDist(), m_seqStarts(), m_preDists(), m_postDists(), m_nameStarts(), m_names() {}
 
-  const RSiteRead& operator[](int idx) const { return m_rReads[idx];     }
-  RSiteRead& operator[](int idx)             { return m_rReads[idx];     }
+  void SetReverseComplements(bool withRC);   // Whether every sequence is followed by its reverse complement (set before adding)
+  bool HasReverseComplements() const         { return m_withRC;          }
+  int ReadsPerSequence() const               { return (m_withRC? 2: 1);  }
   int NumReads() const                       { return m_readCount;       }
+  int NumSequences() const                   { return m_readCount/ReadsPerSequence(); }
+  bool IsReverse(int idx) const              { return m_withRC && idx%2 == 1; }  // Whether a read is a reverse complement
+  int64_t MemoryBytes() const;               // Memory owned by the store (mapped arrays excluded)
 
-  int AddRead(const RSiteRead& rr); 
+  RSiteRead operator[](int idx) const;
+  // Add a sequence from the positions of its sites (only their differences are kept), returns the index of its first read
+  int AddSequence(const string& name, const int* sitePos, int numSites, int preDist, int postDist);
+  int AddSequence(const RSiteReads& other, int seqIdx); // Copy a sequence of another store
   string ToString() const;
+  void WriteIndex(IndexWriter& writer) const; // Store the reads in an index file
+  bool LoadIndex(IndexReader& reader);        // Map the reads stored in an index file, false if they are corrupt
 
 private:
-  int m_readCount;
-  svec<RSiteRead> m_rReads;  /// List of site reads
+  bool m_withRC;                       /// Whether reverse complement reads are included
+  int m_readCount;                     /// Number of reads (sequences times reads per sequence)
+  FlatArray<int> m_cumDist;            /// Prefix sums of the distances per sequence (one more than its distance count)
+  FlatArray<int64_t> m_seqStarts;      /// First prefix sum of every sequence (one extra entry marking the end)
+  FlatArray<int> m_preDists;           /// Prefix of the forward strand of every sequence
+  FlatArray<int> m_postDists;          /// Postfix of the forward strand of every sequence
+  FlatArray<int64_t> m_nameStarts;     /// First character of every name (one extra entry marking the end)
+  FlatArray<char> m_names;             /// Characters of all names
 };
 
 #endif //RSITERREADS_H
@@ -0,0 +1,163 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <string.h>
+#include <algorithm>
+#include "ryggrad/src/base/Logger.h"
+#include "RSiteScanner.h"
+
+namespace {
+  // 2-bit code of every base (either case), -1 for other letters (e.g. N) and -2 for line breaks
+  struct BaseCodes {
+    signed char m_codes[256];
+    BaseCodes() {
+      for (int c=0; c<256; c++) { m_codes[c] = -1; }
+      m_codes[(unsigned char)'\n'] = -2;
+      m_codes[(unsigned char)'\r'] = -2;
+      const char* bases = "ACGTacgt";
+      for (int b=0; b<8; b++) { m_codes[(unsigned char)bases[b]] = b%4; }
+    }
+  };
+  const BaseCodes s_baseCodes;
+}
+
+RSiteScanner::RSiteScanner(const string& motif) {
+  svec<string> motifs;
+  motifs.push_back(motif);
+  SetMotifs(motifs);
+}
+
+RSiteScanner::RSiteScanner(const svec<string>& motifs) {
+  SetMotifs(motifs);
+}
+
+void RSiteScanner::SetMotifs(const svec<string>& motifs) {
+  m_motifs      = motifs;
+  m_motifLength = (motifs.empty()? 0: motifs[0].length());
+  m_find        = MotifScan::Best();
+  if (m_find == MotifScan::FindScalar || motifs.isize() > s_maxBatchedMotifs) {
+    m_find = NULL; // The rolling code finds all motifs in one pass
+  } else {
+    m_batch.resize(s_batchSize + m_motifLength + MotifScan::BasePadding, 0);
+  }
+  m_codeMask    = (m_motifLength >= 32? UINT64_MAX: ((uint64_t)1 << 2*m_motifLength) - 1);
+  m_sites.clear();
+  m_sites.resize(motifs.isize());
+  svec<pair<uint64_t, int> > codes;
+  for (int motifIdx=0; motifIdx<motifs.isize(); motifIdx++) {
+    if ((int)motifs[motifIdx].length() != m_motifLength) {
+      FILE_LOG(logERROR) << "Motifs must all have the same length: " << motifs[motifIdx];
+      continue;
+    }
+    uint64_t code = 0;
+    bool valid    = true;
+    for (char base:motifs[motifIdx]) {
+      valid &= (s_baseCodes.m_codes[(unsigned char)base] >= 0);
+      code   = (code << 2) | (s_baseCodes.m_codes[(unsigned char)base] & 3);
+    }
+    if (valid) { codes.push_back(make_pair(code, motifIdx)); }
+  }
+  if (m_motifLength <= s_maxTableLength) {
+    m_codeTable.assign(m_codeMask+1, -1);
+    for (const pair<uint64_t, int>& code:codes) { m_codeTable[code.first] = code.second; }
+  } else {
+    sort(codes.begin(), codes.end());
+    for (const pair<uint64_t, int>& code:codes) {
+      m_codes.push_back(code.first);
+      m_codeMotifs.push_back(code.second);
+    }
+  }
+  Start();
+}
+
+int RSiteScanner::FindMotif(uint64_t code) const {
+  if (!m_codeTable.empty()) { return m_codeTable[code]; }
+  svec<uint64_t>::const_iterator it = lower_bound(m_codes.begin(), m_codes.end(), code);
+  if (it == m_codes.end() || *it != code) { return -1; }
+  return m_codeMotifs[it - m_codes.begin()];
+}
+
+void RSiteScanner::Start() {
+  m_carry      = 0;
+  m_code       = 0;
+  m_validCount = 0;
+  m_length     = 0;
+  for (svec<int>& sites:m_sites) { sites.clear(); }
+}
+
+void RSiteScanner::Feed(const char* data, int len) {
+  if (m_find != NULL) { FeedBatched(data, len); }
+  else                { FeedRolling(data, len); }
+}
+
+void RSiteScanner::FeedBatched(const char* data, int len) {
+  int batchLen = m_carry;
+  int k = 0;
+  while (k < len) {
+    // Copy the bases up to the next line break (or until the batch is full)
+    int readLen = min(len-k, s_batchSize-batchLen);
+    const char* lineEnd = (const char*)memchr(data+k, '\n', readLen);
+    if (lineEnd != NULL) { readLen = lineEnd - (data+k); }
+    char* dest = &m_batch[batchLen];
+    memcpy(dest, data+k, readLen);
+    int segLen = readLen;
+    if (memchr(dest, '\r', segLen) != NULL) { segLen = remove(dest, dest+segLen, '\r') - dest; }
+    batchLen += segLen;
+    m_length += segLen;
+    k += readLen + (lineEnd != NULL? 1: 0);
+    if (batchLen == s_batchSize) {
+      ScanBatch(batchLen);
+      batchLen = m_carry;
+    }
+  }
+  ScanBatch(batchLen);
+}
+
+void RSiteScanner::ScanBatch(int batchLen) {
+  int count = batchLen - m_motifLength + 1; // Start positions with a whole motif in the batch
+  if (count > 0) {
+    int batchStart = m_length - batchLen;   // Sequence offset of the first base in the batch
+    for (int motifIdx=0; motifIdx<m_motifs.isize(); motifIdx++) {
+      if ((int)m_motifs[motifIdx].length() != m_motifLength) { continue; }
+      m_find(&m_batch[0], count, m_motifs[motifIdx].c_str(), m_motifLength, batchStart, m_sites[motifIdx]);
+    }
+  }
+  m_carry = min(batchLen, m_motifLength-1);
+  memmove(&m_batch[0], &m_batch[batchLen-m_carry], m_carry);
+}
+
+void RSiteScanner::FeedRolling(const char* data, int len) {
+  for (int k=0; k<len; k++) {
+    int baseCode = s_baseCodes.m_codes[(unsigned char)data[k]];
+    if (baseCode == -2) { continue; } // Line breaks
+    m_length++;
+    if (baseCode < 0) { // No motif can overlap an unknown base
+      m_validCount = 0;
+      continue;
+    }
+    m_code = ((m_code << 2) | baseCode) & m_codeMask;
+    if (++m_validCount < m_motifLength) { continue; }
+    int motifIdx = FindMotif(m_code);
+    if (motifIdx >= 0) {
+      m_sites[motifIdx].push_back(m_length-m_motifLength);
+    }
+  }
+}
+
+int RSiteScanner::Finish(int motifIdx, const string& name, RSiteReads& reads) {
+  svec<int>& sites = m_sites[motifIdx];
+  // A motif ending on the very last base is not counted as a site
+  while (!sites.empty() && sites[sites.isize()-1] >= m_length-m_motifLength) {
+    sites.pop_back();
+  }
+  int preDist = 0, postDist = 0;
+  if (sites.isize() > 1) {
+    // Site positions are taken at the middle of the motif so that sequences are reversible
+    preDist  = sites[0] + m_motifLength/2;                                // prefix (number of trailing bits before the first motif location)
+    postDist = m_length - (sites[sites.isize()-1] + m_motifLength/2) - 1; // postfix (number of leading bits after last motif location
+  }
+  int readIdx = reads.AddSequence(name, sites.data(), sites.isize(), preDist, postDist);
+  FILE_LOG(logDEBUG3) << "Adding Read: " << readIdx << "  " << name << " (" << reads.ReadsPerSequence() << " strands)";
+  return max(0, sites.isize()-1)*reads.ReadsPerSequence(); // Return the total number of sites that have been added
+}
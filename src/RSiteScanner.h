@@ -0,0 +1,54 @@
+#ifndef RSITESCANNER_H
+#define RSITESCANNER_H
+
+#include <stdint.h>
+#include <string>
+#include "RSiteReads.h"
+#include "MotifScan.h"
+
+/* Incremental detection of the restriction sites of a set of equal length motifs in a sequence that arrives in pieces.
+ * Sequence pieces may contain line breaks (which are skipped) and lower case bases,
+ * so raw FASTA bytes can be fed in directly without first assembling the sequence.
+ * For a few motifs on CPUs with SIMD support the bases are gathered into batches without line breaks that are searched with the
+ * MotifScan kernels. Otherwise all motifs are found in a single sweep: the last bases are kept as a rolling 2-bit
+ * code which is looked up in a table of motif codes. */
+class RSiteScanner
+{
+public:
+  RSiteScanner(): m_motifs(), m_motifLength(0), m_find(NULL), m_batch(), m_carry(0), m_codeMask(0), m_codeTable(), m_codes(), 
+                  m_codeMotifs(), m_code(0), m_validCount(0), m_length(0), m_sites() {}
+  RSiteScanner(const string& motif);
+  RSiteScanner(const svec<string>& motifs);
+
+  int  NumMotifs() const                     { return m_sites.isize(); }
+  const char* KernelName() const             { return (m_find != NULL? MotifScan::Name(m_find): "rolling code"); }
+  void Start();                              // Begin a new sequence
+  void Feed(const char* data, int len);      // Scan the next piece of the sequence
+  int  Finish(int motifIdx, const string& name, RSiteReads& reads); // Add the restriction site read(s) of a motif, returns the number of sites added
+
+private:
+  static const int s_maxTableLength = 8;     // Longest motif for which every possible code gets a table entry
+  static const int s_batchSize = 1<<16;      // Number of bases searched per batch by the SIMD kernels
+  static const int s_maxBatchedMotifs = 4;   // The kernels search one motif at a time, so beyond this the rolling code is faster
+  void SetMotifs(const svec<string>& motifs);
+  void FeedBatched(const char* data, int len);
+  void FeedRolling(const char* data, int len);
+  void ScanBatch(int batchLen);              // Search the batch and carry its last bases over to the next one
+  int FindMotif(uint64_t code) const;        // Index of the motif with the given code or -1
+
+  svec<string> m_motifs;     /// Motifs whose sites are being detected
+  int m_motifLength;         /// Length of every motif
+  MotifScan::FindFunc m_find;/// SIMD kernel in use (NULL when the rolling code is used instead)
+  svec<char> m_batch;        /// Bases gathered for the SIMD kernels (with room for the kernel padding)
+  int m_carry;               /// Bases at the front of the batch carried over from the previous batch
+  uint64_t m_codeMask;       /// Bits of the rolling code covering one motif length
+  svec<short> m_codeTable;   /// Motif index for every possible code or -1 (only for motifs up to s_maxTableLength)
+  svec<uint64_t> m_codes;    /// Sorted motif codes (for longer motifs)
+  svec<int> m_codeMotifs;    /// Motif index of every sorted motif code
+  uint64_t m_code;           /// Rolling 2-bit code of the last bases of the sequence
+  int m_validCount;          /// Number of consecutive A/C/G/T bases the rolling code is made of
+  int m_length;              /// Number of bases of the sequence seen so far
+  svec<svec<int> > m_sites;  /// Start offsets of the occurrences found so far for every motif
+};
+
+#endif //RSITESCANNER_H
@@ -4,6 +4,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <omp.h>
 #include "RestSiteAlignUnit.h"
 
 void RestSiteGeneral::GenerateMotifs() {
@@ -87,63 +88,316 @@ void RestSiteGeneral::WriteMatchCandids(const map<int, map<int, int> >& candids)
   }
 }
 
+void RestSiteGeneral::ReadSequenceBatch(FastaReader& reader, svec<SequenceRecord>& batch) const {
+  batch.clear();
+  int64_t batchBytes = 0;
+  string name;
+  const char* data;
+  int len;
+  while(batchBytes < s_ingestBatchBytes && reader.NextRecord(name)) {
+    batch.push_back(SequenceRecord());
+    SequenceRecord& record = batch[batch.isize()-1];
+    record.m_name = name;
+    while(reader.NextChunk(data, len)) {
+      record.m_bases.insert(record.m_bases.end(), data, data+len);
+      if(record.m_bases.isize() >= s_ingestBatchBytes) { // The rest of the sequence is read while scanning
+        record.m_partial = true;
+        return;
+      }
+    }
+    batchBytes += record.m_bases.isize();
+  }
+}
+
+void RestSiteGeneral::ScanSequence(SequenceRecord& record, RSiteScanner& scanner, FastaReader& reader, bool addRC) const {
+  scanner.Start();
+  record.m_size = record.m_bases.isize();
+  if(!record.m_bases.empty()) { scanner.Feed(&record.m_bases[0], record.m_bases.isize()); }
+  svec<char>().swap(record.m_bases);
+  if(record.m_partial) {
+    const char* data;
+    int len;
+    while(reader.NextChunk(data, len)) {
+      scanner.Feed(data, len);
+      record.m_size += len;
+    }
+  }
+  record.m_reads = RSiteReads();
+  record.m_reads.SetReverseComplements(addRC);
+  for(int motifIdx=0; motifIdx<m_motifs.isize(); motifIdx++) {
+    scanner.Finish(motifIdx, record.m_name, record.m_reads);
+  }
+}
+
+int64_t RestSiteGeneral::AddTargetBatch(svec<SequenceRecord>& batch) {
+  int64_t batchBytes = 0;
+  for(int motifIdx=0; motifIdx<m_motifs.isize(); motifIdx++) {
+    RestSiteMapCore& core = m_rsaCores[m_motifs[motifIdx]];
+    for(const SequenceRecord& record:batch) {
+      int readIdx = core.Reads().AddSequence(record.m_reads, motifIdx);
+      for(int k=0; k<core.Reads().ReadsPerSequence(); k++) {
+        RSiteRead rr = core.GetRead(readIdx+k);
+        if(core.IsIndexed(readIdx+k)) { core.IncTotalSiteCount(rr.Size()); } // Sizes the dmer grid
+        FILE_LOG(logDEBUG3) << "Adding Read: " << readIdx+k << "  " << rr.Name() << " " << rr.Ori();
+      }
+    }
+  }
+  for(const SequenceRecord& record:batch) { batchBytes += record.m_size; }
+  batch.clear();
+  return batchBytes;
+}
+
 string RestSiteGeneral::GetTargetName(int readIdx) const {
   if(m_rsaCores.empty())  { return ""; }
   else { return m_rsaCores.begin()->second.Reads()[readIdx].Name(); }
 }
 
-void RestSiteGeneral::SetTargetSites(const string& fileName, bool addRC) {
+void RestSiteGeneral::AddTargetNames(MatchWriter& writer) const {
+  if(m_rsaCores.empty()) { return; }
+  // Reverse complements follow their forward read and share its name, the sequence index of read r is RestSiteMapCore::TargetSeq(r)
+  const RestSiteMapCore& core = m_rsaCores.begin()->second;
+  int readsPerSeq = core.Reads().ReadsPerSequence();
+  for(int readIdx=0; readIdx<core.Reads().NumReads(); readIdx+=readsPerSeq) {
+    writer.AddName(core.GetRead(readIdx).Name());
+  }
+}
+
+bool RestSiteGeneral::SetTargetSites(const string& fileName, bool addRC) {
   for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
     string motif = m_motifs[motifIdx];
     m_rsaCores[motif] = RestSiteMapCore(motif, m_modelParams, m_dataParams);
+    m_rsaCores[motif].Reads().SetReverseComplements(addRC);
   }
- 
-  FlatFileParser parser;
-  parser.Open(fileName);
-  string l;
-  string name;
-  while (parser.ParseLine()) {
-    if (parser.GetItemCount() == 0)
-      continue;
-    if (parser.Line()[0] == '>') {
-      transform(l.begin(), l.end(), l.begin(), ::toupper);
-      for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
-        string motif = m_motifs[motifIdx];
-        int totSiteCnt = m_rsaCores[motif].CreateRSitesPerString(l, name, m_rsaCores[motif].Reads(), addRC);
-        m_rsaCores[motif].IncTotalSiteCount(totSiteCnt);
-      }
-      l.clear();
-      name = parser.Line();
-      name.erase(0,1); //Remove the ">" character from name of sequence
-    }
-    l += parser.Line();
+
+  FastaReader reader;
+  if(!reader.Open(fileName)) {
+    cout << "Could not read input file: " << fileName << endl;
+    return false;
   }
-  if( l != "") {
-    transform(l.begin(), l.end(), l.begin(), ::toupper);
-    for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
-      string motif = m_motifs[motifIdx];
-      int totSiteCnt = m_rsaCores[motif].CreateRSitesPerString(l, name, m_rsaCores[motif].Reads(), addRC);
-      m_rsaCores[motif].IncTotalSiteCount(totSiteCnt);
+  // One thread buffers the next batch of records while the others scan the current one record by record.
+  // Reads are added batch by batch in input order, so read indices do not depend on the number of threads.
+  svec<RSiteScanner> scanners;
+  scanners.resize(omp_get_max_threads(), RSiteScanner(m_motifs));  // Finds all motifs in one sweep over every sequence
+  svec<SequenceRecord> batches[2];
+  int64_t totalBytes = 0;
+  double scanStart   = omp_get_wtime();
+  #pragma omp parallel
+  #pragma omp single
+  {
+    int curr = 0;
+    ReadSequenceBatch(reader, batches[curr]);
+    while(!batches[curr].empty()) {
+      svec<SequenceRecord>& batch = batches[curr];
+      int fullCount = batch.isize() - (batch[batch.isize()-1].m_partial? 1: 0);
+      for(int recIdx=0; recIdx<fullCount; recIdx++) {
+        #pragma omp task firstprivate(recIdx) shared(batch, scanners, reader)
+        ScanSequence(batch[recIdx], scanners[omp_get_thread_num()], reader, addRC);
+      }
+      if(fullCount < batch.isize()) {
+        // A sequence too long to buffer is scanned straight from the input, so the next batch has to wait for it
+        ScanSequence(batch[fullCount], scanners[omp_get_thread_num()], reader, addRC);
+        batches[1-curr].clear();
+      } else {
+        ReadSequenceBatch(reader, batches[1-curr]);
+      }
+      #pragma omp taskwait
+      totalBytes += AddTargetBatch(batch);
+      if(fullCount < batch.isize()) { ReadSequenceBatch(reader, batches[1-curr]); }
+      curr = 1 - curr;
     }
   }
+  double scanTime = omp_get_wtime() - scanStart;
+  FILE_LOG(logINFO) << "Scanned " << totalBytes/(1024*1024) << " MB of sequence for restriction sites in " << scanTime << " s ("
+                    << (scanTime > 0? totalBytes/scanTime/1e9: 0) << " GB/s) on " << omp_get_max_threads() << " threads using the " 
+                    << scanners[0].KernelName() << " motif finder";
   for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
     string motif = m_motifs[motifIdx];
     cout<< "Motif: " << motif << endl;
+    FILE_LOG(logINFO) << "Motif " << motif << ": " << m_rsaCores[motif].Reads().NumReads() << " restriction site reads in " 
+                      << m_rsaCores[motif].Reads().MemoryBytes()/(1024*1024) << " MB";
     m_rsaCores[m_motifs[motifIdx]].BuildDmers();
   }
+  return true;
 }
 
-void RestSiteMapper::FindMatches(const string& fileNameQuery, const string& fileNameTarget) {
+bool RestSiteGeneral::IndexTarget(const string& fileNameTarget, const string& indexFileName) {
   GenerateMotifs(); 
-  map<int, map<int, bool>> checkedSeqs;  // Flagset for sequences that have been searched for a given sequence index and from a specific offset
+  if(!SetTargetSites(fileNameTarget, !m_modelParams.IsSingleStrand())) { return false; }
+  return SaveTargetIndex(indexFileName);
+}
+
+bool RestSiteGeneral::SaveTargetIndex(const string& indexFileName) const {
+  IndexWriter writer;
+  if(!writer.Open(indexFileName)) { return false; }
+  // Only the parameters that shape the index are stored, the search parameters are chosen per mapping run
+  writer.WriteInt(m_modelParams.IsSingleStrand());
+  writer.WriteInt(m_modelParams.MotifLength());
+  writer.WriteInt(m_modelParams.DmerLength());
+  writer.WriteInt(m_modelParams.ForwardIndex());
+  writer.WriteInt(m_motifs.isize());
+  for(const string& motif:m_motifs) {
+    m_rsaCores.at(motif).WriteIndex(writer);
+  }
+  if(!writer.Close()) {
+    FILE_LOG(logERROR) << "Failed writing index file: " << indexFileName;
+    return false;
+  }
+  FILE_LOG(logINFO) << "Wrote the index of " << m_motifs.isize() << " motifs to " << indexFileName;
+  return true;
+}
+
+bool RestSiteGeneral::LoadTargetIndex(const string& indexFileName) {
+  double loadStart = omp_get_wtime();
+  if(!m_targetIndex.Open(indexFileName)) { return false; }
+  bool singleStrand = m_targetIndex.ReadInt();
+  int motifLength   = m_targetIndex.ReadInt();
+  int dmerLength    = m_targetIndex.ReadInt();
+  bool forwardIndex = m_targetIndex.ReadInt();
+  int motifCount    = m_targetIndex.ReadInt();
+  if(m_targetIndex.Failed() || motifCount < 0 || dmerLength < 2 || dmerLength > Dmer::MaxLength) {
+    FILE_LOG(logERROR) << "Corrupt index file: " << indexFileName;
+    return false;
+  }
+  if(singleStrand != m_modelParams.IsSingleStrand() || motifLength != m_modelParams.MotifLength() || motifCount != m_modelParams.NumOfMotifs()
+     || dmerLength != m_modelParams.DmerLength() || forwardIndex != m_modelParams.ForwardIndex()) {
+    FILE_LOG(logWARNING) << "Using the strand, motif, dmer and forward index settings stored in index file " << indexFileName << " instead of the given ones";
+  }
+  m_modelParams = RestSiteModelParams(singleStrand, motifLength, motifCount, dmerLength, m_modelParams.CNDFCoef1(), m_modelParams.CNDFCoef2(),
+                                      m_modelParams.ScoreThreshold(), m_modelParams.StoreDmerBounds(), m_modelParams.LowerNeighbours(), 
+                                      m_modelParams.MinChainSeeds(), m_modelParams.CanonicalPairsOption(), forwardIndex, m_modelParams.Alphabet());
+  m_motifs.clear();
+  m_rsaCores.clear();
+  for(int motifIdx=0; motifIdx<motifCount; motifIdx++) {
+    RestSiteMapCore core("", m_modelParams, m_dataParams);
+    if(!core.MapIndex(m_targetIndex)) { 
+      FILE_LOG(logERROR) << "Corrupt index file: " << indexFileName;
+      m_rsaCores.clear();
+      m_motifs.clear();
+      return false;
+    }
+    m_motifs.push_back(core.m_motif);
+    m_rsaCores[core.m_motif] = std::move(core); // The reads are handed over, the mapped grid is not copied
+  }
+  FILE_LOG(logINFO) << "Loaded the index of " << motifCount << " motifs from " << indexFileName << " in " << omp_get_wtime()-loadStart << " s";
+  return true;
+}
+
+bool RestSiteMapper::FindMatches(const string& fileNameQuery, const string& fileNameTarget) {
+  MatchedPairs checkedSeqs;  // Flagset for sequences that have been searched for a given sequence index and from a specific offset
   int matchCount = 0;
-  SetTargetSites(fileNameTarget, !m_modelParams.IsSingleStrand());
+  MatchWriter writer;
+  if(!writer.Open(m_outFileName, m_binaryOutput)) {
+    cout << "Could not create output file: " << m_outFileName << endl;
+    return false;
+  }
+  if(IndexFile::IsIndex(fileNameTarget)) {
+    if(!LoadTargetIndex(fileNameTarget)) {
+      cout << "Could not load index file: " << fileNameTarget << endl;
+      return false;
+    }
+  } else {
+    GenerateMotifs(); 
+    if(!SetTargetSites(fileNameTarget, !m_modelParams.IsSingleStrand())) { return false; }
+  }
   FILE_LOG(logINFO) << "Created Dmers and starting to search .... ";
-  for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
-    string motif = m_motifs[motifIdx];
-    FILE_LOG(logDEBUG1) << "Finding matches based on motif: " << motif;
-    matchCount += m_rsaCores[motif].FindMapInstances(0.1, checkedSeqs); //TODO parameterise data params
+  int numTargetSeqs = 0;
+  if(writer.IsBinary()) {
+    AddTargetNames(writer);
+    numTargetSeqs = writer.NumNames();
   }
+  if(fileNameQuery != "") {
+    matchCount = MapQueries(fileNameQuery, 0.1, numTargetSeqs, writer); //TODO parameterise data params
+  } else {
+    for(int motifIdx=0; motifIdx<m_modelParams.NumOfMotifs(); motifIdx++) {
+      string motif = m_motifs[motifIdx];
+      FILE_LOG(logDEBUG1) << "Finding matches based on motif: " << motif;
+      matchCount += m_rsaCores[motif].FindMapInstances(0.1, checkedSeqs, writer); //TODO parameterise data params
+    }
+  }
+  if(!writer.Close()) {
+    cout << "Failed writing output file: " << m_outFileName << endl;
+    return false;
+  }
+  FILE_LOG(logINFO) << "Wrote " << writer.BytesWritten()/(1024*1024) << " MB of matches";
   cout << "Total number of matches recorded: " << matchCount << endl;
+  return true;
 }
 
+
+int RestSiteMapper::MapQueries(const string& fileNameQuery, float indelVariance, int firstQuerySeq, MatchWriter& writer) {
+  FastaReader reader;
+  if(!reader.Open(fileNameQuery)) {
+    cout << "Could not read query file: " << fileNameQuery << endl;
+    return 0;
+  }
+  if(m_motifs.empty()) { return 0; }
+  for(const string& motif:m_motifs) {
+    m_rsaCores[motif].PrepareQueries(indelVariance);
+  }
+  // Queries are read in bounded batches and only their forward strand is scanned, as the target holds both strands
+  // (with a forward index the reverse complement targets are searched for with the flipped query, see RestSiteMapCore::CollectSeeds).
+  // Every query is mapped by a single thread and reported in input order, so the output does not depend on the number of threads.
+  int numMotifs = m_motifs.isize();
+  svec<RSiteScanner> scanners;
+  scanners.resize(omp_get_max_threads(), RSiteScanner(m_motifs));
+  svec<SequenceRecord> batch;
+  svec<svec<MatchRecord> > batchMatches;  // Per query and motif
+  int64_t queryCount = 0;
+  int matchCount     = 0;
+  double mapStart    = omp_get_wtime();
+  ValidationStats validationStats;
+  ReadSequenceBatch(reader, batch);
+  while(!batch.empty()) {
+    int fullCount = batch.isize() - (batch[batch.isize()-1].m_partial? 1: 0);
+    if(fullCount < batch.isize()) { ScanSequence(batch[fullCount], scanners[0], reader, false); }
+    batchMatches.clear();
+    batchMatches.resize(batch.isize()*numMotifs);
+    #pragma omp parallel
+    {
+      svec<int> neighbourCells;
+      neighbourCells.resize(m_rsaCores.at(m_motifs[0]).MaxNeighbourCells());
+      ValidationStats stats;
+      #pragma omp for schedule(dynamic, 1)
+      for(int queryIdx=0; queryIdx<batch.isize(); queryIdx++) {
+        if(queryIdx < fullCount) { ScanSequence(batch[queryIdx], scanners[omp_get_thread_num()], reader, false); }
+        set<int> matchedTargets;  // Target read indices agree across motifs
+        for(int motifIdx=0; motifIdx<numMotifs; motifIdx++) {
+          m_rsaCores.at(m_motifs[motifIdx]).MapQuery(batch[queryIdx].m_reads[motifIdx], queryIdx, matchedTargets, neighbourCells, 
+                                                     batchMatches[queryIdx*numMotifs+motifIdx], stats);
+        }
+      }
+      #pragma omp critical
+      validationStats.Add(stats);
+    }
+    int batchQuerySeq = firstQuerySeq + queryCount;  // Query names follow the target names in the binary name table
+    if(writer.IsBinary()) {
+      for(const SequenceRecord& record:batch) { writer.AddName(record.m_name); }
+    }
+    // Threads format the matches of consecutive queries and hand them to the writer in order
+    #pragma omp parallel reduction(+:matchCount)
+    {
+      OutputBuffer out;
+      #pragma omp for ordered schedule(static, 1)
+      for(int queryIdx=0; queryIdx<batch.isize(); queryIdx++) {
+        for(int motifIdx=0; motifIdx<numMotifs; motifIdx++) {
+          const RestSiteMapCore& core = m_rsaCores.at(m_motifs[motifIdx]);
+          for(const MatchRecord& match:batchMatches[queryIdx*numMotifs+motifIdx]) {
+            core.WriteMatch(match, batch[queryIdx].m_reads[motifIdx], batchQuerySeq+queryIdx, core.GetRead(match.Seq1()), 
+                            core.TargetSeq(match.Seq1()), writer.IsBinary(), out);
+            matchCount++;
+          }
+        }
+        #pragma omp ordered
+        writer.Write(out);
+      }
+    }
+    queryCount += batch.isize();
+    ReadSequenceBatch(reader, batch);
+  }
+  FILE_LOG(logINFO) << "Mapped " << queryCount << " query sequences in " << omp_get_wtime()-mapStart << " s on " << omp_get_max_threads() 
+                    << " threads";
+  FILE_LOG(logINFO) << "Validated " << validationStats.m_validated << " candidate matches, " << 100*validationStats.EarlyRate() 
+                    << "% of them rejected early, skipped " << validationStats.m_memoHits << " rejected on the same diagonal ("
+                    << 100*validationStats.MemoHitRate() << "% memo hits)";
+  return matchCount;
+}
@@ -6,30 +6,58 @@
 #include "ryggrad/src/base/CommandLineParser.h"
 #include "ryggrad/src/base/FileParser.h"
 #include "RSiteReads.h"
+#include "FastaReader.h"
 #include "MappedInstance.h"
 #include "RestSiteCoreUnit.h"
 
+/* A target or query sequence on its way through ingestion: the raw bases (dropped once scanned) and the resulting 
+ * restriction site reads, per motif the forward read followed by its reverse complement if requested */
+class SequenceRecord
+{
+public:
+  SequenceRecord(): m_name(), m_bases(), m_partial(false), m_size(0), m_reads() {}
+
+  string m_name;            /// Sequence name
+  svec<char> m_bases;       /// Raw FASTA bytes of the sequence
+  bool m_partial;           /// Whether the sequence was too long to buffer and the rest is still to be read
+  int64_t m_size;           /// Number of raw bytes in the sequence
+  RSiteReads m_reads;       /// Restriction site reads generated from the sequence (one sequence per motif)
+};
+
 class RestSiteGeneral 
 {
 public:
-  RestSiteGeneral(): m_rsaCores(), m_motifs(), m_modelParams(), m_dataParams() {}
-  RestSiteGeneral(const RestSiteModelParams& mParams): m_motifs(), m_modelParams(mParams), m_dataParams() {}
+  RestSiteGeneral(): m_rsaCores(), m_motifs(), m_modelParams(), m_dataParams(), m_targetIndex(), m_outFileName(), m_binaryOutput(false) {}
+  RestSiteGeneral(const RestSiteModelParams& mParams): m_motifs(), m_modelParams(mParams), m_dataParams(), m_targetIndex(), m_outFileName(), m_binaryOutput(false) {}
 
   /* Generate Permutation of the given alphabet to reach number of motifs required */
   void GenerateMotifs();  
   bool ValidateMotif(const string& motif, const vector<char>& alphabet, const map<char, char>& RCs) const; 
-  void SetTargetSites(const string& fileName, bool addRC); 
+  bool SetTargetSites(const string& fileName, bool addRC); // False if the input cannot be read
+  bool IndexTarget(const string& fileNameTarget, const string& indexFileName); // Build the target sites and dmers and store them
+  bool SaveTargetIndex(const string& indexFileName) const;
+  bool LoadTargetIndex(const string& indexFileName); // Map a stored index instead of building the target sites and dmers
   string GetTargetName(int readIdx) const;
+  void SetOutput(const string& fileName, bool binary) { m_outFileName = fileName; m_binaryOutput = binary; } // Standard output if no file name
 
   virtual void WriteMatchCandids(const map<int, map<int, int> >& candids) const; 
-  virtual void FindMatches(const string& fileNameQuery, const string& fileNameTarget) = 0; 
+  virtual bool FindMatches(const string& fileNameQuery, const string& fileNameTarget) = 0; // False if the matches could not be written
 
 protected:
   void CartesianPower(const vector<char>& input, unsigned k, vector<vector<char>>& result) const; 
+  void ReadSequenceBatch(FastaReader& reader, svec<SequenceRecord>& batch) const; // Buffer the next records (up to s_ingestBatchBytes)
+  void ScanSequence(SequenceRecord& record, RSiteScanner& scanner, FastaReader& reader, bool addRC) const; 
+  int64_t AddTargetBatch(svec<SequenceRecord>& batch);  // Add the batch's reads in input order, returns the bytes scanned
+  void AddTargetNames(MatchWriter& writer) const;       // Name table entries of the target sequences (binary output)
+
+  static const int64_t s_ingestBatchBytes = 1<<26;  // Sequence bytes buffered per ingestion batch
   map<string, RestSiteMapCore> m_rsaCores;   /// Mapping engine (core data and functionality) per motif
   svec<string> m_motifs;                     /// Vector of all motifs for which restriction site reads have been generated
   RestSiteModelParams m_modelParams;         /// Model Parameters
   RestSiteDataParams m_dataParams;           /// Model Parameters
+  IndexReader m_targetIndex;                 /// Index file the target dmer grids are mapped from (if any)
+  string m_outFileName;                      /// File the matches are written to (standard output if empty)
+  bool m_binaryOutput;                       /// Whether the matches are written as binary overlap records instead of PAF
 };
 
 class RestSiteMapper : public RestSiteGeneral 
@@ -38,9 +66,10 @@ public:
   RestSiteMapper() {} 
   RestSiteMapper(const RestSiteModelParams& mParams): RestSiteGeneral(mParams) {}
 
-  virtual void FindMatches(const string& fileNameQuery, const string& fileNameTarget); 
+  virtual bool FindMatches(const string& fileNameQuery, const string& fileNameTarget); 
 
 private:
+  int MapQueries(const string& fileNameQuery, float indelVariance, int firstQuerySeq, MatchWriter& writer); // Map every query against the target, returns the match count
 };
 
 #endif //OPTIMAPALIGNUNIT_H
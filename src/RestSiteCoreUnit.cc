@@ -5,52 +5,16 @@
 #include "ryggrad/src/base/Logger.h"
 #include "RestSiteCoreUnit.h"
 #include <math.h>
+#include <omp.h>
 
-int RestSiteMapCore:: CreateRSitesPerString(const string& origString, const string& origName, RSiteReads& reads, bool addRC) const {
+int RestSiteMapCore:: CreateRSitesPerString(const string& origString, const string& origName, RSiteReads& reads) const {
   if (origString == "" && origName == "") {
     return 0;
   }
-  svec<int> mm;
-  RSiteRead rr;
-  rr.Name() = origName;
-  int motifLen = m_motif.length();
-  int origLen  = origString.length();
-  mm.reserve(origLen/motifLen);
-  bool wrotePrefix = false;
-  int n = -1;
-  for (int i=0; i<origLen-motifLen ; i++) {
-    int j = 0;
-    for (j=0; j<motifLen; j++) {
-      if (m_motif[j] != origString[i+j])
-        break;
-    }
-    if (j == motifLen) {
-      if (n >= 0) {
-        // Obtain the pre/post & dmer values
-        if (!wrotePrefix) {
-          rr.PreDist() = n; // prefix (number of trailing bits before the first motif location)
-          wrotePrefix = true; 
-        }
-        mm.push_back(i+motifLen/2-n);
-      } 
-      n = i + motifLen/2; // Set point to middle of motif so that sequences are reversible
-    }
-    if (origString != "") {
-      if(wrotePrefix) { 
-        rr.PostDist() = origLen - n - 1; // postfix (number of leading bits after last motif location
-      } 
-    }
-  } 
-  rr.Dist() = mm;
-  int readIdx = reads.AddRead(rr);
-  FILE_LOG(logDEBUG3) << "Adding Read: " << readIdx << "  " << rr.Name() << " " << rr.Ori();
-  if(addRC) {  
-    rr.Flip();
-    readIdx = reads.AddRead(rr);
-    FILE_LOG(logDEBUG3) << "Adding Read: " << readIdx << "  " << rr.Name() << " " << rr.Ori();
-    return 2*mm.isize(); // Return the total number of sites that have been added
-  }
-  return mm.isize(); // Return the total number of sites that have been added
+  RSiteScanner scanner(m_motif);
+  scanner.Start();
+  scanner.Feed(origString.c_str(), origString.length());
+  return scanner.Finish(0, origName, reads);
 }
 
 //TODO this is a very rough way of estimating memory and should be improved 
@@ -62,56 +26,330 @@ void RestSiteMapCore::BuildDmers() {
     dimCount = pow(1900000000, 1.0/m_modelParams.DmerLength()); 
   }
   FILE_LOG(logINFO) << "Estimated number of Dmers and dimension size for dmer storage: " << TotalSiteCount() << "  " << dimCount; 
-  m_dmers.BuildDmers(m_rReads , m_modelParams.DmerLength(), m_modelParams.MotifLength(), dimCount); 
-}
-
-int RestSiteMapCore::FindMapInstances(float indelVariance, map<int, map<int,bool>>& checkedSeqs) const {
-  int counter       = 0;
-  double matchCount = 0;
-  int loopLim       = m_dmers.NumCells();
-  svec<int> neighbourCells;
-  neighbourCells.reserve(pow(2, m_modelParams.DmerLength()));
-  svec<int> deviations;
-  deviations.resize(m_modelParams.DmerLength());
-
-  for (int iterIndex=0; iterIndex<loopLim; iterIndex++) {
-    counter++;
-    if (counter % 100000 == 0) {
-//      cout << "\rLOG Progress: " << 100*(double)iterIndex/(double)loopLim << "%" << flush;
+  m_dmers.BuildDmers(m_rReads , m_modelParams.DmerLength(), m_modelParams.MotifLength(), dimCount, m_modelParams.ForwardIndex()); 
+}
+
+void RestSiteMapCore::WriteIndex(IndexWriter& writer) const {
+  writer.WriteString(m_motif);
+  writer.WriteFloat(m_totalSiteCnt);
+  m_rReads.WriteIndex(writer);
+  m_dmers.WriteIndex(writer);
+}
+
+bool RestSiteMapCore::MapIndex(IndexReader& reader) {
+  m_motif        = reader.ReadString();
+  m_totalSiteCnt = reader.ReadFloat();
+  // The grid refers to the reads and is searched with the dmer length of the index header (see RestSiteGeneral::LoadTargetIndex)
+  return m_rReads.LoadIndex(reader) && m_dmers.MapIndex(reader, m_rReads, m_modelParams.DmerLength());
+}
+
+int RestSiteMapCore::FindMapInstances(float indelVariance, MatchedPairs& checkedSeqs, MatchWriter& writer) {
+  m_dmers.BuildDeviations(indelVariance, m_modelParams.CNDFCoef1(), m_modelParams.StoreDmerBounds());
+  m_validator = DPMatcher(indelVariance, m_modelParams.CNDFCoef2(), m_threshScore);
+
+  // Cells are very skewed in population, so hand out the most populated ones first and let idle threads pick up the rest
+  svec<int> cellOrder;
+  for (int iterIndex=0; iterIndex<m_dmers.NumCells(); iterIndex++) {
+    cellOrder.push_back(iterIndex);
+  }
+  sort(cellOrder.begin(), cellOrder.end(), [this](int c1, int c2) { 
+    return (m_dmers.CellSize(c1) != m_dmers.CellSize(c2)? m_dmers.CellSize(c1) > m_dmers.CellSize(c2): c1 < c2); 
+  });
+  FILE_LOG(logINFO) << "Searching " << cellOrder.isize() << " non-empty cells using " << omp_get_max_threads() << " threads and the "
+                    << DmerScan::Name(DmerScan::Best()) << " dmer comparison kernel";
+
+  MappingHandler handler = GetMappingHandler();
+  double searchStart = omp_get_wtime();
+  svec<svec<MatchRecord> > threadMatches;
+  threadMatches.resize(omp_get_max_threads());
+  ValidationStats validationStats;
+  #pragma omp parallel
+  {
+    ValidationMemo memo;
+    ValidationStats stats;
+    svec<int> neighbourCells;
+    neighbourCells.resize(MaxNeighbourCells());
+    svec<int> deviations;
+    deviations.resize(m_modelParams.DmerLength());
+    svec<MatchRecord>& matches = threadMatches[omp_get_thread_num()];
+    if(m_modelParams.MinChainSeeds() > 0 || m_modelParams.ForwardIndex()) {
+      // Seeds are chained or flipped per read, so reads rather than cells are handed out
+      #pragma omp for schedule(dynamic, 1)
+      for (int readIdx=0; readIdx<m_rReads.NumReads(); readIdx++) {
+        HandleReadChains(readIdx, checkedSeqs, neighbourCells, matches, memo, stats);
+      }
+    } else {
+      #pragma omp for schedule(dynamic, 1)
+      for (int orderIdx=0; orderIdx<cellOrder.isize(); orderIdx++) {
+        int iterIndex = cellOrder[orderIdx];
+        FILE_LOG(logDEBUG2) << "Number of dmers in cell " << m_dmers.CellId(iterIndex) << " " << m_dmers.CellSize(iterIndex); 
+        (this->*handler)(iterIndex, checkedSeqs, neighbourCells, deviations, false, matches, memo, stats);
+      }
     }
-    if(!m_dmers[iterIndex].empty()) {
-      FILE_LOG(logDEBUG2) << "Number of dmers in cell " << iterIndex << " " << m_dmers[iterIndex].isize(); 
-      matchCount += HandleMappingInstance(m_dmers[iterIndex], indelVariance, checkedSeqs, neighbourCells, deviations, false);
+    #pragma omp critical
+    validationStats.Add(stats);
+  }
+
+  FILE_LOG(logINFO) << "Searched cells in " << omp_get_wtime()-searchStart << " s with per-dmer bounds " << (m_dmers.HasBounds()? "stored": "looked up");
+  FILE_LOG(logINFO) << "Validated " << validationStats.m_validated << " candidate matches, " << 100*validationStats.EarlyRate() 
+                    << "% of them rejected early, skipped " << validationStats.m_memoHits << " rejected on the same diagonal ("
+                    << 100*validationStats.MemoHitRate() << "% memo hits)";
+
+  // Only keep the match that a serial search would have found first for every pair and report in serial order
+  svec<MatchRecord> accepted;
+  for(const svec<MatchRecord>& matches:threadMatches) {
+    for(const MatchRecord& match:matches) {
+      int seq1 = match.Seq1(), seq2 = match.Seq2();
+      if(m_modelParams.CanonicalPairs()) { CanonicalSeqs(seq1, seq2); } // Accepted in any orientation (see ValidateCanonical)
+      if(checkedSeqs.GetSearchOrder(seq1, seq2) == match.SearchOrder()) { accepted.push_back(match); }
     }
   }
-  return matchCount;
+  sort(accepted.begin(), accepted.end());
+  // Threads format consecutive chunks of matches and hand them to the writer in order
+  int chunkCount = (accepted.isize() + s_formatChunk - 1) / s_formatChunk;
+  #pragma omp parallel
+  {
+    OutputBuffer out;
+    #pragma omp for ordered schedule(static, 1)
+    for(int chunkIdx=0; chunkIdx<chunkCount; chunkIdx++) {
+      int chunkEnd = min(accepted.isize(), (chunkIdx+1)*s_formatChunk);
+      for(int matchIdx=chunkIdx*s_formatChunk; matchIdx<chunkEnd; matchIdx++) {
+        WriteMatch(accepted[matchIdx], writer.IsBinary(), out);
+      }
+      #pragma omp ordered
+      writer.Write(out);
+    }
+  }
+  checkedSeqs.Seal();
+  FILE_LOG(logINFO) << "Matched pairs so far: " << checkedSeqs.NumPairs() << " using " << checkedSeqs.MemoryBytes()/(1024*1024) << " MB";
+  return accepted.isize();
+}
+
+void RestSiteMapCore::PrepareQueries(float indelVariance) {
+  m_dmers.BuildDeviations(indelVariance, m_modelParams.CNDFCoef1(), m_modelParams.StoreDmerBounds());
+  m_validator = DPMatcher(indelVariance, m_modelParams.CNDFCoef2(), m_threshScore);
 }
 
-int RestSiteMapCore::HandleMappingInstance(const svec<Dmer>& dmers, float indelVariance, map<int, map<int,bool>>& checkedSeqs,
-                                           svec<int>& neighbourCells, svec<int>& deviations, bool acceptSameIdx) const {
+int RestSiteMapCore::MapQuery(const RSiteRead& query, int queryIdx, set<int>& matchedTargets, 
+                              svec<int>& neighbourCells, svec<MatchRecord>& matches, ValidationStats& stats) const {
+  // Same search as HandleMappingInstance with the query dmers in place of the indexed ones; the query is never part of the index,
+  // so every indexed read is a candidate and each target is reported once for the query (over all motifs sharing matchedTargets)
+  svec<Seed> seeds;
+  CollectSeeds(query, queryIdx, -1, SearchLowerNeighbours(false), neighbourCells, seeds);
+  SeedChains chains;
+  if(m_modelParams.MinChainSeeds() > 0) { 
+    chains.Build(seeds); 
+  }
+  int numCandidates = (m_modelParams.MinChainSeeds() > 0? chains.NumChains(): seeds.isize());
   int matchCount = 0;
-   for(Dmer dm1:dmers) {
-    neighbourCells.clear();
-    deviations.clear();
-    dm1.CalcDeviations(deviations, indelVariance, m_modelParams.CNDFCoef1()); //TODO this does not need to be redone every time!
+  ValidationMemo memo(s_queryMemoLogSize);
+  Dmer dm1, dm2;
+  dm1.Seq() = queryIdx;
+  for(int candIdx=0; candIdx<numCandidates; candIdx++) {
+    if(m_modelParams.MinChainSeeds() > 0 && !chains.IsCandidate(candIdx, m_modelParams.MinChainSeeds())) { continue; }
+    const Seed& seed = (m_modelParams.MinChainSeeds() > 0? chains[candIdx].m_anchor: seeds[candIdx]);
+    if(matchedTargets.count(seed.m_target) > 0) { continue; }
+    if(memo.IsRejected(seed.m_target, queryIdx, seed.m_targetPos-seed.m_pos)) {
+      stats.m_memoHits++;
+      continue;
+    }
+    dm1.Pos() = seed.m_pos;
+    dm2.Seq() = seed.m_target;
+    dm2.Pos() = seed.m_targetPos;
+    MatchInfo matchInfo;
+    DPMatcher::Verdict verdict = m_validator.Validate(dm2, GetRead(dm2.Seq()), dm1, query, matchInfo);
+    stats.m_validated++;
+    if(verdict == DPMatcher::RejectedEarly) { stats.m_rejectedEarly++; }
+    if(verdict != DPMatcher::Accepted) {
+      memo.SetRejected(seed.m_target, queryIdx, seed.m_targetPos-seed.m_pos);
+    } else {
+      matchedTargets.insert(dm2.Seq());
+      matches.push_back(MatchRecord(dm2, dm1, matchInfo, 0, matchCount));
+      matchCount++;
+    }
+  }
+  return matchCount;
+}
+
+void RestSiteMapCore::CollectSeeds(const RSiteRead& read, int readIdx, int excludeSeq, bool lowerNeighbours, svec<int>& neighbourCells, 
+                                   svec<Seed>& seeds) const {
+  AddSeeds(read, readIdx, excludeSeq, lowerNeighbours, false, neighbourCells, seeds);
+  if(m_modelParams.ForwardIndex() && m_rReads.HasReverseComplements()) {
+    // A match of the flipped read with read t is the match of the read with t^1, so excluding excludeSeq excludes excludeSeq^1 here
+    AddSeeds(read.Flipped(), readIdx, (excludeSeq < 0? -1: excludeSeq^1), lowerNeighbours, true, neighbourCells, seeds);
+  }
+}
+
+void RestSiteMapCore::AddSeeds(const RSiteRead& read, int readIdx, int excludeSeq, bool lowerNeighbours, bool flipped, 
+                               svec<int>& neighbourCells, svec<Seed>& seeds) const {
+  int dmerLength = m_modelParams.DmerLength();
+  svec<Dmer> dmers;
+  m_dmers.GenerateDmers(read, readIdx, dmers);
+  if(flipped) {
+    // Keep the seeds of every target in the order of their offsets on the read as given
+    reverse(dmers.begin(), dmers.end());
+  }
+  int lower[Dmer::MaxLength], upper[Dmer::MaxLength], deviations[Dmer::MaxLength];
+  DmerScan::ScanFunc scan = DmerScan::Best();
+  for(const Dmer& dm1:dmers) {
+    for(int i=0; i<dmerLength; i++) {
+      deviations[i] = m_dmers.Deviation(dm1[i]);
+      lower[i]      = dm1[i] - deviations[i];
+      upper[i]      = dm1[i] + deviations[i];
+    }
     int merLoc = m_dmers.MapNToOneDim(dm1.Data());
-    m_dmers.FindNeighbourCells(merLoc, dm1, deviations, neighbourCells); 
-    for (int nCell:neighbourCells) {
-      for (auto dm2:m_dmers[nCell]) {
-        if(checkedSeqs[dm1.Seq()][dm2.Seq()]) {// || checkedSeqs[dm2.Seq()][dm1.Seq()]) {
-          continue;  //Check if current pair has not been matched already 
+    int nCellCount = m_dmers.FindNeighbourCells(merLoc, dm1, deviations, lowerNeighbours, &neighbourCells[0]);
+    for (int nIdx=0; nIdx<nCellCount; nIdx++) {
+      int nCell = m_dmers.FindCell(neighbourCells[nIdx]);
+      if(nCell < 0) { continue; } // Empty cell
+      int nCellSize = m_dmers.CellSize(nCell);
+      for (int blockStart=0; blockStart<nCellSize; blockStart+=DmerScan::BlockSize) {
+        uint32_t matchMask = scan(lower, upper, dmerLength, m_dmers.CellValues(nCell)+blockStart, nCellSize, m_dmers.CellSeqs(nCell)+blockStart,
+                                  min(DmerScan::BlockSize, nCellSize-blockStart), excludeSeq);
+        for (; matchMask; matchMask&=matchMask-1) {
+          int merIdx2 = m_dmers.CellStart(nCell) + blockStart + __builtin_ctz(matchMask);
+          if(!flipped) {
+            seeds.push_back(Seed(m_dmers.MerSeq(merIdx2), dm1.Pos(), m_dmers.MerPos(merIdx2)));
+          } else {
+            // A dmer at offset pos of a read starts at offset size-length-pos of the other strand
+            int target = m_dmers.MerSeq(merIdx2);
+            seeds.push_back(Seed(target^1, read.Size()-dmerLength-dm1.Pos(), GetRead(target).Size()-dmerLength-m_dmers.MerPos(merIdx2)));
+          }
         }
-        int offset = abs(dm1.Pos() - dm2.Pos());
-        FILE_LOG(logDEBUG3) << "Checking dmer match: dmer1 - " << dm1.ToString() << " dmer2 - " << dm2.ToString() << " offset: " << offset << endl;
-        if(dm1.IsMatch(dm2, deviations, acceptSameIdx)) {
+      }
+    }
+  }
+}
+
+int RestSiteMapCore::HandleReadChains(int readIdx, MatchedPairs& checkedSeqs, svec<int>& neighbourCells, 
+                                      svec<MatchRecord>& matches, ValidationMemo& memo, ValidationStats& stats) const {
+  // Reads take the place of cells in the search order: all pairs with the read as the first one are decided here
+  uint64_t searchOrder = MatchedPairs::SearchOrder(readIdx, 0);
+  if(m_modelParams.CanonicalPairs() && m_rReads.IsReverse(readIdx)) { return 0; } // Mirrored from the forward strand
+  memo.Clear(); // Only rejections of this read count, whatever the thread handled before
+  svec<Seed> seeds;
+  CollectSeeds(GetRead(readIdx), readIdx, readIdx, SearchLowerNeighbours(true), neighbourCells, seeds); // Same sequence is not a real match
+  if(m_modelParams.CanonicalPairs()) {
+    // Pairs with a lower sequence are decided from the forward strand of that sequence
+    int seq = TargetSeq(readIdx);
+    seeds.erase(remove_if(seeds.begin(), seeds.end(), [&](const Seed& seed) { return TargetSeq(seed.m_target) < seq; }), seeds.end());
+  }
+  SeedChains chains;
+  if(m_modelParams.MinChainSeeds() > 0) {
+    chains.Build(seeds);
+  }
+  int numCandidates = (m_modelParams.MinChainSeeds() > 0? chains.NumChains(): seeds.isize());
+  int matchCount = 0;
+  Dmer dm1, dm2, validated1, validated2;
+  dm1.Seq() = readIdx;
+  for(int candIdx=0; candIdx<numCandidates; candIdx++) {
+    if(m_modelParams.MinChainSeeds() > 0 && !chains.IsCandidate(candIdx, m_modelParams.MinChainSeeds())) { continue; }
+    const Seed& anchor = (m_modelParams.MinChainSeeds() > 0? chains[candIdx].m_anchor: seeds[candIdx]);
+    if(checkedSeqs.IsMatched(readIdx, anchor.m_target, searchOrder)) { continue; }
+    dm1.Pos() = anchor.m_pos;
+    dm2.Seq() = anchor.m_target;
+    dm2.Pos() = anchor.m_targetPos;
+    MatchInfo matchInfo;
+    DPMatcher::Verdict verdict;
+    if(m_modelParams.CanonicalPairs()) {
+      // The read is on its forward strand and the target not lower, so the pair is canonical already
+      verdict = ValidateCanonical(dm1, dm2, matchInfo, validated1, validated2, memo, stats);
+    } else {
+      verdict = ValidateMatch(dm1, dm2, matchInfo, memo, stats);
+      validated1 = dm1;
+      validated2 = dm2;
+    }
+    if(verdict == DPMatcher::Accepted) {
+      checkedSeqs.SetMatched(readIdx, anchor.m_target, searchOrder);
+      matches.push_back(MatchRecord(validated1, validated2, matchInfo, searchOrder, matchCount));
+      matchCount++;
+    }
+  }
+  return matchCount;
+}
+
+RestSiteMapCore::MappingHandler RestSiteMapCore::GetMappingHandler() const {
+  switch(m_modelParams.DmerLength()) {
+    case 2:  return &RestSiteMapCore::HandleMappingInstance<2>;
+    case 3:  return &RestSiteMapCore::HandleMappingInstance<3>;
+    case 4:  return &RestSiteMapCore::HandleMappingInstance<4>;
+    case 5:  return &RestSiteMapCore::HandleMappingInstance<5>;
+    case 6:  return &RestSiteMapCore::HandleMappingInstance<6>;
+    case 7:  return &RestSiteMapCore::HandleMappingInstance<7>;
+    case 8:  return &RestSiteMapCore::HandleMappingInstance<8>;
+    case 9:  return &RestSiteMapCore::HandleMappingInstance<9>;
+    case 10: return &RestSiteMapCore::HandleMappingInstance<10>;
+    case 11: return &RestSiteMapCore::HandleMappingInstance<11>;
+    case 12: return &RestSiteMapCore::HandleMappingInstance<12>;
+  }
+  FILE_LOG(logERROR) << "Unsupported dmer length: " << m_modelParams.DmerLength();
+  return NULL;
+}
+
+template<int N>
+int RestSiteMapCore::HandleMappingInstance(int cellIdx, MatchedPairs& checkedSeqs, svec<int>& neighbourCells,
+                                           svec<int>& deviations, bool acceptSameIdx, svec<MatchRecord>& matches, 
+                                           ValidationMemo& memo, ValidationStats& stats) const {
+  memo.Clear(); // Only rejections within this cell count, whatever the thread handled before
+  int matchCount = 0;
+  Dmer dm1, dm2, canonical1, canonical2, validated1, validated2;
+  int lower[Dmer::MaxLength], upper[Dmer::MaxLength];
+  DmerScan::ScanFunc scan = DmerScan::Best();
+  for(int merIdx1=m_dmers.CellStart(cellIdx); merIdx1<m_dmers.CellEnd(cellIdx); merIdx1++) {
+    m_dmers.GetDmer(cellIdx, merIdx1, dm1);
+    uint64_t searchOrder = MatchedPairs::SearchOrder(cellIdx, merIdx1-m_dmers.CellStart(cellIdx));
+    if(m_dmers.HasBounds()) {
+      copy(m_dmers.MerLower(merIdx1), m_dmers.MerLower(merIdx1)+N, lower);
+      copy(m_dmers.MerUpper(merIdx1), m_dmers.MerUpper(merIdx1)+N, upper);
+      for(int i=0; i<N; i++) { deviations[i] = upper[i] - dm1[i]; }
+    } else {
+      for(int i=0; i<N; i++) {
+        deviations[i] = m_dmers.Deviation(dm1[i]);
+        lower[i]      = dm1[i] - deviations[i];
+        upper[i]      = dm1[i] + deviations[i];
+      }
+    }
+    int excludeSeq = (acceptSameIdx? -1: dm1.Seq()); // Same sequence is not a real match
+    int merLoc = m_dmers.MapNToOneDim(dm1.Data());
+    int nCellCount = m_dmers.FindNeighbourCells(merLoc, dm1, &deviations[0], m_modelParams.LowerNeighbours(), &neighbourCells[0]);
+    for (int nIdx=0; nIdx<nCellCount; nIdx++) {
+      int nCell = m_dmers.FindCell(neighbourCells[nIdx]);
+      if(nCell < 0) { continue; } // Empty cell
+      int nCellSize = m_dmers.CellSize(nCell);
+      for (int blockStart=0; blockStart<nCellSize; blockStart+=DmerScan::BlockSize) {
+        // The batched dmer comparison is much cheaper than the pair lookup, so only look up pairs of matching dmers
+        uint32_t matchMask = scan(lower, upper, N, m_dmers.CellValues(nCell)+blockStart, nCellSize, m_dmers.CellSeqs(nCell)+blockStart,
+                                  min(DmerScan::BlockSize, nCellSize-blockStart), excludeSeq);
+        for (; matchMask; matchMask&=matchMask-1) {
+          int merIdx2 = m_dmers.CellStart(nCell) + blockStart + __builtin_ctz(matchMask);
+          m_dmers.GetDmer(nCell, merIdx2, dm2);
+          int offset = abs(dm1.Pos() - dm2.Pos());
+          FILE_LOG(logDEBUG3) << "Checking dmer match: dmer1 - " << dm1.ToString() << " dmer2 - " << dm2.ToString() << " offset: " << offset << endl;
+          const Dmer* first  = &dm1;
+          const Dmer* second = &dm2;
+          if(m_modelParams.CanonicalPairs()) {
+            // The match of the forward strands is found as well, as both of its dmers are searched for
+            if(m_rReads.IsReverse(dm1.Seq()) && m_rReads.IsReverse(dm2.Seq())) { continue; }
+            CanonicalPair(dm1, dm2, canonical1, canonical2);
+            first  = &canonical1;
+            second = &canonical2;
+          }
+          if(checkedSeqs.IsMatched(first->Seq(), second->Seq(), searchOrder)) { continue; }
           // Refinement check
           FILE_LOG(logDEBUG3) << "verifying match" << endl;
           MatchInfo matchInfo;
-          float side1Score, side2Score = 0;
-          ValidateMatch(dm1, dm2, indelVariance, matchInfo, side1Score, side2Score); 
-          bool passed = WriteMatchPAF(dm1, dm2, matchInfo, side1Score, side2Score);
-          if(passed) {
-            checkedSeqs[dm1.Seq()][dm2.Seq()]=true;
+          DPMatcher::Verdict verdict;
+          const Dmer* validated[2] = {first, second};
+          if(m_modelParams.CanonicalPairs()) {
+            verdict = ValidateCanonical(*first, *second, matchInfo, validated1, validated2, memo, stats);
+            validated[0] = &validated1;
+            validated[1] = &validated2;
+          } else {
+            verdict = ValidateMatch(*first, *second, matchInfo, memo, stats);
+          }
+          if(verdict == DPMatcher::Accepted) {
+            checkedSeqs.SetMatched(first->Seq(), second->Seq(), searchOrder);
+            matches.push_back(MatchRecord(*validated[0], *validated[1], matchInfo, searchOrder, matchCount));
             matchCount++;
             FILE_LOG(logDEBUG3) << "Matched: " << RSToString(dm1.Seq(), 0) << endl << RSToString(dm2.Seq(), 0);
           }
@@ -122,56 +360,135 @@ int RestSiteMapCore::HandleMappingInstance(const svec<Dmer>& dmers, float indelV
   return matchCount;
 }
 
-void RestSiteMapCore::ValidateMatch(const Dmer& dmer1, const Dmer& dmer2, float indelVariance, MatchInfo& matchInfo,
-                                    float& side1Score, float& side2Score) const {
-  DPMatcher validator;
-  float matchScore = validator.FindMatch(dmer1, dmer2, Reads(), indelVariance, m_modelParams.CNDFCoef2(), matchInfo, side1Score, side2Score);
+void RestSiteMapCore::CanonicalPair(const Dmer& dm1, const Dmer& dm2, Dmer& first, Dmer& second) const {
+  bool swapped = TargetSeq(dm1.Seq()) > TargetSeq(dm2.Seq());
+  first.Seq()  = (swapped? dm2: dm1).Seq();
+  first.Pos()  = (swapped? dm2: dm1).Pos();
+  second.Seq() = (swapped? dm1: dm2).Seq();
+  second.Pos() = (swapped? dm1: dm2).Pos();
+  if(m_rReads.IsReverse(first.Seq())) {
+    MirrorDmer(first);
+    MirrorDmer(second);
+  }
+}
+
+void RestSiteMapCore::CanonicalSeqs(int& seq1, int& seq2) const {
+  if(TargetSeq(seq1) > TargetSeq(seq2)) { swap(seq1, seq2); }
+  if(m_rReads.IsReverse(seq1)) {
+    seq1 ^= 1;
+    seq2 ^= 1;
+  }
 }
 
-bool RestSiteMapCore::WriteMatchPAF(const Dmer& dm1, const Dmer& dm2, const MatchInfo& matchInfo, 
-                                    float& side1Score, float& side2Score) const {
-  string name_query    = GetRead(dm2.Seq()).Name();
-  int length_query     = GetBasePos(dm2, GetRead(dm2.Seq()).Size(), true); //This function will find the total length of the sequence in bases
-  int startBase_query  = GetBasePos(dm2, matchInfo.GetFirstMatchPos2(), false); 
-  int endBase_query    = GetBasePos(dm2, matchInfo.GetLastMatchPos2(), true); 
-  char strand_query    = (GetRead(dm2.Seq()).Ori()>0? '+': '-');
+void RestSiteMapCore::MirrorDmer(Dmer& dmer) const {
+  // A dmer at offset pos of a read starts at offset size-length-pos of the other strand
+  dmer.Pos() = GetRead(dmer.Seq()).Size() - m_modelParams.DmerLength() - dmer.Pos();
+  dmer.Seq() ^= 1;
+}
+
+DPMatcher::Verdict RestSiteMapCore::ValidateCanonical(const Dmer& first, const Dmer& second, MatchInfo& matchInfo, Dmer& dmer1, Dmer& dmer2,
+                                                      ValidationMemo& memo, ValidationStats& stats) const {
+  // The walk depends on the order of the reads and on the strand (see DPMatcher), and the search without canonical pairs reports 
+  // a pair if any of its orientations passes, so a canonical pair is only rejected once all of them fail
+  int numOrientations = (m_rReads.HasReverseComplements()? 4: 2);
+  DPMatcher::Verdict verdict = DPMatcher::Rejected;
+  for(int orientation=0; orientation<numOrientations && verdict != DPMatcher::Accepted; orientation++) {
+    const Dmer& from1 = (orientation%2 == 0? first: second);
+    const Dmer& from2 = (orientation%2 == 0? second: first);
+    dmer1.Seq() = from1.Seq();
+    dmer1.Pos() = from1.Pos();
+    dmer2.Seq() = from2.Seq();
+    dmer2.Pos() = from2.Pos();
+    if(orientation >= 2) {
+      MirrorDmer(dmer1);
+      MirrorDmer(dmer2);
+    }
+    verdict = ValidateMatch(dmer1, dmer2, matchInfo, memo, stats);
+  }
+  return verdict;
+}
+
+DPMatcher::Verdict RestSiteMapCore::ValidateMatch(const Dmer& dmer1, const Dmer& dmer2, MatchInfo& matchInfo,
+                                                  ValidationMemo& memo, ValidationStats& stats) const {
+  // Accepted pairs are never validated again (see MatchedPairs), so only rejections are memoised
+  int diagonal = dmer1.Pos() - dmer2.Pos();
+  if(memo.IsRejected(dmer1.Seq(), dmer2.Seq(), diagonal)) {
+    stats.m_memoHits++;
+    return DPMatcher::Rejected;
+  }
+  // The validator is set up for the indel variance of the search and the threshold score
+  DPMatcher::Verdict verdict = m_validator.Validate(dmer1, GetRead(dmer1.Seq()), dmer2, GetRead(dmer2.Seq()), matchInfo);
+  stats.m_validated++;
+  if(verdict == DPMatcher::RejectedEarly) { stats.m_rejectedEarly++; }
+  if(verdict != DPMatcher::Accepted)      { memo.SetRejected(dmer1.Seq(), dmer2.Seq(), diagonal); }
+  return verdict;
+}
+
+void RestSiteMapCore::FillOverlap(const MatchRecord& match, const RSiteRead& query, const RSiteRead& target, OverlapRecord& overlap) const {
+  const MatchInfo& matchInfo = match.GetMatchInfo();
+  overlap.m_queryLen       = GetBasePos(query, query.Size(), true); //This function will find the total length of the sequence in bases
+  overlap.m_queryStart     = GetBasePos(query, matchInfo.GetFirstMatchPos2(), false); 
+  overlap.m_queryEnd       = GetBasePos(query, matchInfo.GetLastMatchPos2(), true); 
+  overlap.m_strand         = (query.Ori()*target.Ori()>0? 1: -1); // Relative strand, either read may be a reverse complement
   // Items useful for assembly
-  int preDist_query    = GetRead(dm2.Seq()).PreDist();
-  int postDist_query   = length_query - GetRead(dm2.Seq()).PostDist();
+  overlap.m_queryPreDist   = query.PreDist();
+  overlap.m_queryPostDist  = overlap.m_queryLen - query.PostDist();
  
-  string name_target   = GetRead(dm1.Seq()).Name();
-  int length_target    = GetBasePos(dm1, GetRead(dm1.Seq()).Size(), true); //This function will find the total length of the sequence in bases
-  int startBase_target = GetBasePos(dm1, matchInfo.GetFirstMatchPos1(), false); 
-  int endBase_target   = GetBasePos(dm1, matchInfo.GetLastMatchPos1(), true); 
+  overlap.m_targetLen      = GetBasePos(target, target.Size(), true); //This function will find the total length of the sequence in bases
+  overlap.m_targetStart    = GetBasePos(target, matchInfo.GetFirstMatchPos1(), false); 
+  overlap.m_targetEnd      = GetBasePos(target, matchInfo.GetLastMatchPos1(), true); 
   // Items useful for assembly
-  int preDist_target   = GetRead(dm1.Seq()).PreDist();
-  int postDist_target  = length_target - GetRead(dm1.Seq()).PostDist();
-  
-  float matchScore     = matchInfo.GetIdentScore();
-  //int  numMatches      = matchInfo.GetNumMatches();
-  int  alignBlockLen   = max(endBase_query-startBase_query, endBase_target-startBase_target);
-  int  mappingQual     = 255;
-
-  char delim = '\t';
-
-  if(matchScore>GetThresholdScore()) {
-    cout << name_query << delim << length_query << delim << startBase_query 
-        << delim << endBase_query << delim << strand_query << delim << name_target 
-        << delim << length_target << delim << startBase_target << delim << endBase_target
-        << delim << matchScore << delim << alignBlockLen << delim << mappingQual << delim;
-    //Auxillary info:
-    cout << "queryPreDist:" << preDist_query << delim << "queryPostDist:" << postDist_query << delim 
-         << "targetPreDist:" << preDist_target << delim << "targetPostDist:" << postDist_target;
-    cout << endl;
-    return true;
-  }
-  return false; //Did not pass acceptance threshold
+  overlap.m_targetPreDist  = target.PreDist();
+  overlap.m_targetPostDist = overlap.m_targetLen - target.PostDist();
+  overlap.m_score          = matchInfo.GetIdentScore();
+  overlap.m_padding[0] = overlap.m_padding[1] = overlap.m_padding[2] = 0;
+}
+
+void RestSiteMapCore::WriteMatch(const MatchRecord& match, bool binary, OutputBuffer& out) const {
+  if(!m_modelParams.CanonicalPairs()) {
+    WriteMatch(match, GetRead(match.Seq2()), TargetSeq(match.Seq2()), GetRead(match.Seq1()), TargetSeq(match.Seq1()), binary, out);
+    return;
+  }
+  RSiteRead query  = GetRead(match.Seq2());
+  RSiteRead target = GetRead(match.Seq1());
+  string queryName = query.Name(), targetName = target.Name();
+  OverlapRecord overlap;
+  overlap.m_querySeq  = TargetSeq(match.Seq2());
+  overlap.m_targetSeq = TargetSeq(match.Seq1());
+  FillOverlap(match, query, target, overlap);
+  // The canonical match stands for the pair in either order and, with reverse complements, for the mirrored pair as well
+  // (unless both reads come from the same sequence, where mirroring only exchanges them)
+  AppendOverlap(overlap, queryName, targetName, binary, out);
+  AppendOverlap(overlap.Swapped(), targetName, queryName, binary, out);
+  if(m_rReads.HasReverseComplements() && overlap.m_querySeq != overlap.m_targetSeq) {
+    OverlapRecord mirrored = overlap.Mirrored();
+    AppendOverlap(mirrored, queryName, targetName, binary, out);
+    AppendOverlap(mirrored.Swapped(), targetName, queryName, binary, out);
+  }
+}
+
+void RestSiteMapCore::WriteMatch(const MatchRecord& match, const RSiteRead& query, int querySeq, const RSiteRead& target, int targetSeq, 
+                                 bool binary, OutputBuffer& out) const {
+  OverlapRecord overlap;
+  overlap.m_querySeq  = querySeq;
+  overlap.m_targetSeq = targetSeq;
+  FillOverlap(match, query, target, overlap);
+  AppendOverlap(overlap, query.Name(), target.Name(), binary, out);
+}
+
+void RestSiteMapCore::AppendOverlap(const OverlapRecord& overlap, const string& queryName, const string& targetName, bool binary, 
+                                    OutputBuffer& out) const {
+  if(binary) {
+    out.Append(overlap);
+  } else {
+    overlap.AppendPAF(queryName, targetName, out);
+  }
 }
 
 float RestSiteMapCore::GetThresholdScore() const { 
   float thresh = m_modelParams.ScoreThreshold(); 
   if(thresh<0) { //Automatic computation
-    thresh = 0.2 + 0.1*(1-exp(-2*(m_modelParams.CNDFCoef2()-1)));  //TODO parameterise and save value not to recalculate everytime
+    thresh = 0.2 + 0.1*(1-exp(-2*(m_modelParams.CNDFCoef2()-1)));  //TODO parameterise
   }
   return thresh;
 }
@@ -195,17 +512,17 @@ float RestSiteMapCore::GetRandomMatchProb() const {
 }
 
 int RestSiteMapCore::GetBasePos(int seqIdx, int rsPos, bool inclusive) const {
-  const RSiteRead& rSites = GetRead(seqIdx);
-  int cmPos = rSites.PreDist(); //cumulative position
+  return GetBasePos(GetRead(seqIdx), rsPos, inclusive);
+}
+
+int RestSiteMapCore::GetBasePos(const RSiteRead& rSites, int rsPos, bool inclusive) const {
   int upto = (inclusive? rsPos: rsPos-1);
   bool includePostDist = false;
   if(rsPos==rSites.Size()) { 
     upto--;
     includePostDist = true;
   } 
-  for(int i=0; i<=upto; i++) {
-    cmPos += rSites[i];
-  }
+  int cmPos = rSites.PreDist() + rSites.DistSum(0, upto+1); //cumulative position
   if(includePostDist) { cmPos += rSites.PostDist(); }
   return cmPos;
 }
@@ -2,10 +2,16 @@
 #define RESTSITECOREUNIT_H
 
 #include <string>
+#include <set>
 #include "RSiteReads.h"
 #include "Dmers.h"
+#include "DmerScan.h"
 #include "DPMatcher.h"
 #include "MappedInstance.h"
+#include "MatchedPairs.h"
+#include "SeedChains.h"
+#include "RSiteScanner.h"
+#include "MatchWriter.h"
 
 class RestSiteDataParams 
 {
@@ -37,10 +43,14 @@ class RestSiteModelParams
 public:
   RestSiteModelParams(bool singleStrand=false, int motifLength=4, int numOfMotifs=1, 
                       int dmerLength=6, float cndfCoef1=2.0, float cndfCoef2=1.0, 
-                      float sThresh =0.2, const vector<char>& alphabet= {'A', 'C', 'G', 'T' }) 
+                      float sThresh =0.2, bool dmerBounds=false, bool lowerNeighbours=false, int minChainSeeds=0,
+                      bool canonicalPairs=false, bool forwardIndex=false,
+                      const vector<char>& alphabet= {'A', 'C', 'G', 'T' }) 
                      :m_singleStrand(singleStrand), m_motifLength(motifLength), m_numOfMotifs(numOfMotifs),
                       m_dmerLength(dmerLength), m_cndfCoef1(cndfCoef1), m_cndfCoef2(cndfCoef2), 
-                      m_scoreThresh(sThresh), m_alphabet(alphabet) { }
+                      m_scoreThresh(sThresh), m_dmerBounds(dmerBounds), m_lowerNeighbours(lowerNeighbours), 
+                      m_minChainSeeds(minChainSeeds), m_canonicalPairs(canonicalPairs), m_forwardIndex(forwardIndex), 
+                      m_alphabet(alphabet) { }
 
   bool   IsSingleStrand() const        { return m_singleStrand;    }
   int    MotifLength() const           { return m_motifLength;     }  
@@ -49,6 +59,13 @@ public:
   float  CNDFCoef1() const             { return m_cndfCoef1;       }
   float  CNDFCoef2() const             { return m_cndfCoef2;       }
   float  ScoreThreshold() const        { return m_scoreThresh;     }
+  bool   StoreDmerBounds() const       { return m_dmerBounds;      }
+  bool   LowerNeighbours() const       { return m_lowerNeighbours; }
+  int    MinChainSeeds() const         { return m_minChainSeeds;   }
+  // Reverse complements are missing from a forward index, so pairs are searched from the forward strands as in canonical pair mode
+  bool   CanonicalPairs() const        { return m_canonicalPairs || m_forwardIndex; }
+  bool   CanonicalPairsOption() const  { return m_canonicalPairs;  } // As requested, whatever the index implies
+  bool   ForwardIndex() const          { return m_forwardIndex;    }
   int    AlphabetSize() const          { return m_alphabet.size(); }
   const vector<char>& Alphabet() const { return m_alphabet;        }
 
@@ -61,6 +78,11 @@ private:
   float   m_cndfCoef1;      /// Cumulative Normal Distribution Function coefficeint used for estimating similarity at filtering stage 
   float   m_cndfCoef2;      /// Cumulative Normal Distribution Function coefficeint used for estimating similarity at  refinement stage
   float   m_scoreThresh;    /// Score threshold for accepting alignment refinement 
+  bool    m_dmerBounds;     /// Flag specifying whether the filtering bounds of every dmer are stored (faster search, more memory)
+  bool    m_lowerNeighbours; /// Flag specifying whether the lower as well as the upper neighbour cells are searched
+  int     m_minChainSeeds;  /// Seeds a chain needs to be validated, 0 to validate every seed as it is found (see SeedChains)
+  bool    m_canonicalPairs; /// Flag specifying whether all against all search decides every pair of sequences once (see CanonicalPair, ValidateCanonical)
+  bool    m_forwardIndex;   /// Flag specifying whether only forward reads get dmers, reverse complements being matched by flipped dmers
   vector<char>  m_alphabet; /// Alphabet containing base letters used in the reads/motifs in lexographic order 
 };
 
@@ -73,29 +95,60 @@ class RestSiteMapCore
 
 public:
   //Default Ctor
-  RestSiteMapCore(): m_motif(), m_totalSiteCnt(0), m_rReads(), m_dmers() {}
+  RestSiteMapCore(): m_motif(), m_totalSiteCnt(0), m_rReads(), m_validator(), m_dmers() { m_threshScore = GetThresholdScore(); }
 
   //Ctor 1
   RestSiteMapCore(string motif, const RestSiteModelParams& mp, const RestSiteDataParams& dp)
-                   : m_motif(motif), m_modelParams(mp), m_dataParams(dp), m_rReads(), m_dmers() {}
+                   : m_motif(motif), m_modelParams(mp), m_dataParams(dp), m_totalSiteCnt(0), m_rReads(), m_validator(), m_dmers() { 
+    m_threshScore = GetThresholdScore(); 
+  }
 
   int  TotalSiteCount() const              { return m_totalSiteCnt; }
   void IncTotalSiteCount(int cnt)          { m_totalSiteCnt += cnt; }
-  const RSiteRead& GetRead(int rIdx) const { return m_rReads[rIdx]; }
+  RSiteRead GetRead(int rIdx) const        { return m_rReads[rIdx]; }
+  bool IsIndexed(int rIdx) const           { return !m_modelParams.ForwardIndex() || !m_rReads.IsReverse(rIdx); } // Whether a read has dmers
   const RSiteReads& Reads() const          { return m_rReads;       }
+  int  MaxNeighbourCells() const           { return m_dmers.MaxNeighbourCells(SearchLowerNeighbours(true)); }
 
   string RSToString(int rIdx, int offset) const; //Convert RestSite read to string from given offset 
   string RSToString(const Dmer& dmer) const;     // read index and offset provided as dmer object
 
-  int  CreateRSitesPerString(const string& origString, const string& origName, RSiteReads& reads, bool addRC) const; 
+  int  CreateRSitesPerString(const string& origString, const string& origName, RSiteReads& reads) const; // Strands as set up in reads
 
   void BuildDmers(); 
-  int FindMapInstances(float indelVariance, map<int, map<int,bool>>& checkedSeqs) const; 
-  int HandleMappingInstance(const svec<Dmer>& dmers, float indelVariance, map<int, map<int,bool>>& checkedSeqs,
-                            svec<int>& neighbourCells, svec<int>& deviations, bool acceptSameIdx) const;
-  void ValidateMatch(const Dmer& dmer1, const Dmer& dmer2, float indelVariance, MatchInfo& matchInfo, float& side1Score, float& side2Score) const;
-  bool WriteMatchPAF(const Dmer& dm1, const Dmer& dm2, const MatchInfo& matchInfo, float& side1Score, float& side2Score) const;
+  void WriteIndex(IndexWriter& writer) const; // Store the reads and dmer grid in an index file
+  bool MapIndex(IndexReader& reader);         // Use the reads and dmer grid stored in a mapped index file, false if corrupt
+  int FindMapInstances(float indelVariance, MatchedPairs& checkedSeqs, MatchWriter& writer); 
+  void PrepareQueries(float indelVariance); // Set up the dmer grid and the validator for MapQuery
+  int MapQuery(const RSiteRead& query, int queryIdx, set<int>& matchedTargets, svec<int>& neighbourCells, 
+               svec<MatchRecord>& matches, ValidationStats& stats) const; // Find the reads matching a read from outside the index
+  template<int N>
+  int HandleMappingInstance(int cellIdx, MatchedPairs& checkedSeqs, svec<int>& neighbourCells,
+                            svec<int>& deviations, bool acceptSameIdx, svec<MatchRecord>& matches, ValidationMemo& memo, 
+                            ValidationStats& stats) const;
+  // Search for the matches of one read of the index from its seeds, chained or in the order found, in place of the cell by cell search
+  int HandleReadChains(int readIdx, MatchedPairs& checkedSeqs, svec<int>& neighbourCells, svec<MatchRecord>& matches, 
+                       ValidationMemo& memo, ValidationStats& stats) const;
+  // The pair of reads standing for the dmer match in canonical pair mode: the lower sequence first and on its forward strand,
+  // i.e. the match of the reverse complements with mirrored offsets and/or the reads swapped (only Seq and Pos are set)
+  void CanonicalPair(const Dmer& dm1, const Dmer& dm2, Dmer& first, Dmer& second) const;
+  void CanonicalSeqs(int& seq1, int& seq2) const; // Reads of the canonical pair, the same for every orientation of a pair
+  void MirrorDmer(Dmer& dmer) const;              // Same dmer on the other strand of its read
+  // ValidateMatch for a canonical pair that tries the swapped and the mirrored orientations too before the pair counts as rejected;
+  // dmer1 and dmer2 are set to the orientation of the last validation
+  DPMatcher::Verdict ValidateCanonical(const Dmer& first, const Dmer& second, MatchInfo& matchInfo, Dmer& dmer1, Dmer& dmer2,
+                                       ValidationMemo& memo, ValidationStats& stats) const;
+  // Refinement decision against the threshold score for the indel variance the validator was set up with (see FindMapInstances and 
+  // PrepareQueries), pairs rejected on the same diagonal before are rejected again without validation
+  DPMatcher::Verdict ValidateMatch(const Dmer& dmer1, const Dmer& dmer2, MatchInfo& matchInfo, ValidationMemo& memo, ValidationStats& stats) const;
+  int  TargetSeq(int rIdx) const { return rIdx/m_rReads.ReadsPerSequence(); } // Sequence a read comes from (see RSiteReads)
+  void FillOverlap(const MatchRecord& match, const RSiteRead& query, const RSiteRead& target, OverlapRecord& overlap) const;
+  // PAF line or binary overlap record, in canonical pair mode followed by those of the swapped and mirrored pairs
+  void WriteMatch(const MatchRecord& match, bool binary, OutputBuffer& out) const;
+  void WriteMatch(const MatchRecord& match, const RSiteRead& query, int querySeq, const RSiteRead& target, int targetSeq, 
+                  bool binary, OutputBuffer& out) const;
   int GetBasePos(int seqIdx, int rsPos, bool inclusive) const; 
+  int GetBasePos(const RSiteRead& rSites, int rsPos, bool inclusive) const; 
   int GetBasePos(const Dmer& dm, int rsPos, bool inclusive) const;
   float GetThresholdScore() const; 
   float GetRandomMatchProb() const;
@@ -103,12 +156,33 @@ public:
 protected:
   RSiteReads& Reads()             { return m_rReads; }
 
+  typedef int (RestSiteMapCore::*MappingHandler)(int, MatchedPairs&, svec<int>&, svec<int>&, bool, svec<MatchRecord>&,
+                                                 ValidationMemo&, ValidationStats&) const;
+  MappingHandler GetMappingHandler() const; // Specialisation of HandleMappingInstance for the dmer length in use
+  // Dmer matches of a read in the index (excluding the read excludeSeq), in the order the search finds them.
+  // With a forward index the matches of the reverse complement reads follow, found from the flipped read (see AddSeeds)
+  void CollectSeeds(const RSiteRead& read, int readIdx, int excludeSeq, bool lowerNeighbours, svec<int>& neighbourCells, 
+                    svec<Seed>& seeds) const;
+  // Dmer matches of one strand of a read; the matches of a flipped read with forward reads are added as those of the read with 
+  // their reverse complements, so that seeds always refer to the read as given
+  void AddSeeds(const RSiteRead& read, int readIdx, int excludeSeq, bool lowerNeighbours, bool flipped, svec<int>& neighbourCells, 
+                svec<Seed>& seeds) const;
+  // Chained search in canonical pair mode finds all seeds of a pair from the lower sequence, so it searches both neighbour directions
+  bool SearchLowerNeighbours(bool chained) const { 
+    return m_modelParams.LowerNeighbours() || (chained && m_modelParams.CanonicalPairs()); 
+  }
+  void AppendOverlap(const OverlapRecord& overlap, const string& queryName, const string& targetName, bool binary, OutputBuffer& out) const;
+
 private:
+  static const int s_formatChunk = 4096;  // Matches formatted by a thread before handing them to the writer
+  static const int s_queryMemoLogSize = 10; // Rejections remembered while mapping a query (see ValidationMemo)
   string m_motif;                    /// Vector of all motifs for which restriction site reads have been generated
   RestSiteModelParams m_modelParams; /// Model Parameters
   RestSiteDataParams m_dataParams;   /// Data Parameters
   double  m_totalSiteCnt;            /// The total of restriction site count over all reads
+  float   m_threshScore;             /// Score threshold for accepting a match at refinement stage (see GetThresholdScore)
   RSiteReads m_rReads;               /// Restriction Site reads per motif
+  DPMatcher m_validator;             /// Refinement of dmer matches for the indel variance of the current search
   Dmers  m_dmers;                    /// To build dmers from restriction site reads
 };
 
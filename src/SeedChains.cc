@@ -0,0 +1,46 @@
+#ifndef FORCE_DEBUG
+#define NDEBUG
+#endif
+
+#include <algorithm>
+#include <tuple>
+#include "SeedChains.h"
+
+void SeedChains::Build(svec<Seed>& seeds) {
+  m_chains.clear();
+  sort(seeds.begin(), seeds.end(), [](const Seed& s1, const Seed& s2) {
+    int diagonal1 = s1.Diagonal(), diagonal2 = s2.Diagonal();
+    return tie(s1.m_target, diagonal1, s1.m_pos) < tie(s2.m_target, diagonal2, s2.m_pos);
+  });
+  int bandStart = 0;
+  for(int seedIdx=1; seedIdx<=seeds.isize(); seedIdx++) {
+    if(seedIdx < seeds.isize() && seeds[seedIdx].m_target == seeds[seedIdx-1].m_target
+       && seeds[seedIdx].Diagonal() - seeds[seedIdx-1].Diagonal() <= s_diagonalBand) { continue; }
+    AddChain(&seeds[bandStart], seedIdx-bandStart);
+    bandStart = seedIdx;
+  }
+  // Rank the chains of every target, ties going to the chain starting first so that the choice does not depend on the search
+  sort(m_chains.begin(), m_chains.end(), [](const SeedChain& c1, const SeedChain& c2) {
+    return tie(c1.m_anchor.m_target, c2.m_numSeeds, c1.m_anchor.m_pos, c1.m_anchor.m_targetPos)
+           < tie(c2.m_anchor.m_target, c1.m_numSeeds, c2.m_anchor.m_pos, c2.m_anchor.m_targetPos);
+  });
+  for(int chainIdx=1; chainIdx<m_chains.isize(); chainIdx++) {
+    if(m_chains[chainIdx].m_anchor.m_target == m_chains[chainIdx-1].m_anchor.m_target) {
+      m_chains[chainIdx].m_rank = m_chains[chainIdx-1].m_rank + 1;
+    }
+  }
+}
+
+void SeedChains::AddChain(Seed* band, int bandSize) {
+  sort(band, band+bandSize, [](const Seed& s1, const Seed& s2) { return tie(s1.m_pos, s1.m_targetPos) < tie(s2.m_pos, s2.m_targetPos); });
+  m_chained.clear();
+  for(int seedIdx=0; seedIdx<bandSize; seedIdx++) {
+    if(m_chained.empty() || (band[seedIdx].m_pos > band[m_chained.back()].m_pos && band[seedIdx].m_targetPos > band[m_chained.back()].m_targetPos)) {
+      m_chained.push_back(seedIdx);
+    }
+  }
+  SeedChain chain;
+  chain.m_anchor   = band[m_chained[m_chained.isize()/2]];
+  chain.m_numSeeds = m_chained.isize();
+  m_chains.push_back(chain);
+}
@@ -0,0 +1,53 @@
+#ifndef SEEDCHAINS_H
+#define SEEDCHAINS_H
+
+#include "ryggrad/src/base/SVector.h"
+
+/* Dmer match between the read being searched for and a target read, given by the offsets of both dmers */
+struct Seed
+{
+  Seed(): m_target(-1), m_pos(-1), m_targetPos(-1) {}
+  Seed(int target, int pos, int targetPos): m_target(target), m_pos(pos), m_targetPos(targetPos) {}
+
+  int Diagonal() const { return m_pos - m_targetPos; }
+
+  int m_target;     /// Read index of the target
+  int m_pos;        /// Offset of the dmer in the read being searched for
+  int m_targetPos;  /// Offset of the dmer in the target
+};
+
+/* Colinear seeds shared with a target read, validated from its middle seed */
+struct SeedChain
+{
+  SeedChain(): m_anchor(), m_numSeeds(0), m_rank(0) {}
+
+  Seed m_anchor;    /// Middle seed of the chain
+  int m_numSeeds;   /// Number of seeds in the chain
+  int m_rank;       /// Position amongst the chains of the same target, best supported first
+};
+
+/* Chains the seeds of one read per target read. Seeds are grouped into bands of nearby diagonals, so that a few missing or
+ * extra sites do not break a chain, and within a band the seeds advancing on both reads form the chain.
+ * Chains of different bands of the same target (e.g. repeats) are kept apart and ranked by the number of their seeds. */
+class SeedChains
+{
+public:
+  SeedChains(): m_chains(), m_chained() {}
+
+  void Build(svec<Seed>& seeds);  // Chain the seeds (which get reordered), replacing any earlier chains
+  int NumChains() const                         { return m_chains.isize(); }
+  const SeedChain& operator[](int idx) const    { return m_chains[idx];    }
+  // Whether a chain is worth validating: one of the best chains of its target with enough seeds
+  bool IsCandidate(int idx, int minSeeds) const { return m_chains[idx].m_rank < s_maxPerTarget && m_chains[idx].m_numSeeds >= minSeeds; }
+
+private:
+  static const int s_diagonalBand = 2;  // Largest diagonal step between consecutive seeds of a band
+  static const int s_maxPerTarget = 2;  // Chains validated per target at most
+
+  void AddChain(Seed* band, int bandSize);  // Chain the seeds of a band (which get reordered)
+
+  svec<SeedChain> m_chains;  /// Chains ordered by target, best supported first
+  svec<int> m_chained;       /// Seeds of the band being chained
+};
+
+#endif //SEEDCHAINS_H
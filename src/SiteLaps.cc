@@ -8,8 +8,17 @@
 
 int main( int argc, char** argv )
 {
+  // "SiteLaps index ..." stores the target sites and dmers in an index file that later runs can map instead of the FASTA input
+  bool indexMode = (argc > 1 && string(argv[1]) == "index");
+  if(indexMode) {
+    argc--;
+    argv++;
+  }
 
-  commandArg<string> fileCmmd("-i","input fasta file");
+  commandArg<string> fileCmmd("-i","input fasta file or index file created in index mode");
+  commandArg<string> queryCmmd("-q","query fasta file to map against the input (all against all within the input if not given)", "");
+  commandArg<string> outCmmd("-o","output file: matches in PAF format (standard output if not given) or the index in index mode", "");
+  commandArg<string> formatCmmd("-f","output format of the matches: paf or bin (binary overlap records, see OverlapToPAF)", "paf");
   commandArg<int> dmerCmmd("-d","dmer length", 4);
   commandArg<int> motifLenCmmd("-ml","Motif Length", 4);
   commandArg<int> motifCntCmmd("-mc","Number of motifs to use", 1);
@@ -17,11 +26,19 @@ int main( int argc, char** argv )
   commandArg<double> ndfcCmmd1("-nc1", "Coefficient to determine how much room to allow for differences in dmers in filtering stage", 2.5);
   commandArg<double> ndfcCmmd2("-nc2", "Coefficient to determine how much room to allow for differences in dmers in refinement stage", 1.0);
   commandArg<double> sThreshCmmd("-t", "Threshold of score for accepting a mapping at refinement stage. Default will be internally computed", -1.0);
+  commandArg<bool> boundsCmmd("-b", "1: store the filtering bounds of every dmer (faster search, more memory) or 0: look them up per query", 0);
+  commandArg<bool> lowerNbrCmmd("-nl", "1: also search the lower neighbour cells of every dmer (higher recall, slower) or 0: upper neighbour cells only", 0);
+  commandArg<int>  chainCmmd("-cs", "Seeds on a diagonal needed to validate a read pair from their chain, or 0: validate every seed as it is found", 0);
+  commandArg<bool> canonicalCmmd("-cp", "1: decide every pair of sequences once in all against all mode (from whichever orientation passes) and write the swapped and mirrored records from it or 0: search every strand and order", 0);
+  commandArg<bool> forwardIdxCmmd("-fi", "1: only index the forward strand and search for reverse complements with flipped dmers (half the dmers, implies -cp) or 0: index both strands", 0);
   commandArg<int>  coreCmmd("-n","Number of Cores to run with", 2);
   commandArg<string> appLogCmmd("-L","Application logging file","application.log");
   commandLineParser P(argc,argv);
   P.SetDescription("Find overlaps in restriction maps.");
   P.registerArg(fileCmmd);
+  P.registerArg(queryCmmd);
+  P.registerArg(outCmmd);
+  P.registerArg(formatCmmd);
   P.registerArg(dmerCmmd);
   P.registerArg(motifLenCmmd);
   P.registerArg(motifCntCmmd);
@@ -29,11 +46,19 @@ int main( int argc, char** argv )
   P.registerArg(ndfcCmmd1);
   P.registerArg(ndfcCmmd2);
   P.registerArg(sThreshCmmd);
+  P.registerArg(boundsCmmd);
+  P.registerArg(lowerNbrCmmd);
+  P.registerArg(chainCmmd);
+  P.registerArg(canonicalCmmd);
+  P.registerArg(forwardIdxCmmd);
   P.registerArg(coreCmmd);
  
   P.parse();
   
   string fileName   = P.GetStringValueFor(fileCmmd);
+  string queryFile  = P.GetStringValueFor(queryCmmd);
+  string outFile    = P.GetStringValueFor(outCmmd);
+  string outFormat  = P.GetStringValueFor(formatCmmd);
   int dmerLen       = P.GetIntValueFor(dmerCmmd);
   int motifLen      = P.GetIntValueFor(motifLenCmmd);
   int motifCnt      = P.GetIntValueFor(motifCntCmmd);
@@ -41,9 +66,35 @@ int main( int argc, char** argv )
   double ndfCoef1   = P.GetDoubleValueFor(ndfcCmmd1);
   double ndfCoef2   = P.GetDoubleValueFor(ndfcCmmd2);
   double scoreThresh= P.GetDoubleValueFor(sThreshCmmd);
+  bool dmerBounds   = P.GetBoolValueFor(boundsCmmd);
+  bool lowerNbrs    = P.GetBoolValueFor(lowerNbrCmmd);
+  int minChainSeeds = P.GetIntValueFor(chainCmmd);
+  bool canonical    = P.GetBoolValueFor(canonicalCmmd);
+  bool forwardIndex = P.GetBoolValueFor(forwardIdxCmmd);
   int numOfCores    = P.GetIntValueFor(coreCmmd);
     string logFile  = P.GetStringValueFor(appLogCmmd);
 
+  if(dmerLen < 2 || dmerLen > Dmer::MaxLength) {
+    cout << "Dmer length must be between 2 and " << Dmer::MaxLength << endl;
+    return 1;
+  }
+  if(minChainSeeds < 0) {
+    cout << "Chain seeds must not be negative" << endl;
+    return 1;
+  }
+  if(outFormat != "paf" && outFormat != "bin") {
+    cout << "Output format must be paf or bin" << endl;
+    return 1;
+  }
+  if(outFormat == "bin" && outFile == "") {
+    cout << "Binary output requires an output file (-o)" << endl;
+    return 1;
+  }
+  if(indexMode && outFile == "") {
+    cout << "Index mode requires an output index file (-o)" << endl;
+    return 1;
+  }
+
   FILE* pFile               = fopen(logFile.c_str(), "w");
   Output2FILE::Stream()     = pFile;
   FILELog::ReportingLevel() = logINFO;
@@ -54,8 +105,13 @@ int main( int argc, char** argv )
 
   omp_set_num_threads(numOfCores); //The sort functions use OpenMP
 
-  RestSiteModelParams mParams(singleStrand, motifLen, motifCnt, dmerLen, ndfCoef1, ndfCoef2, scoreThresh); 
+  RestSiteModelParams mParams(singleStrand, motifLen, motifCnt, dmerLen, ndfCoef1, ndfCoef2, scoreThresh, dmerBounds, lowerNbrs, minChainSeeds, canonical, 
+                              forwardIndex); 
   RestSiteMapper rsMapper(mParams);
+  if(indexMode) {
+    return (rsMapper.IndexTarget(fileName, outFile)? 0: 1);
+  }
+  rsMapper.SetOutput(outFile, outFormat == "bin");
 
   clock_t clock1_optiLoad, clock2_overlapCand, clock3_finalOverlaps, clock4_done;
   // 1a. Populate the motifs 
@@ -63,7 +119,7 @@ int main( int argc, char** argv )
   clock1_optiLoad = clock();
 
   // 2. Build Optimers and find those that share a seed as cadidates for overlap detection 
-  rsMapper.FindMatches("", fileName); 
+  bool written = rsMapper.FindMatches(queryFile, fileName); 
   clock2_overlapCand = clock();
  
   // 3. Take the overlap candidates and refine to remove false positives
@@ -82,5 +138,5 @@ int main( int argc, char** argv )
        << ((double) (clock3_finalOverlaps-clock2_overlapCand) / CLOCKS_PER_SEC)
        << endl;
 
-  return 0;
+  return (written? 0: 1);
 }
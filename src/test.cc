@@ -1,4 +1,6 @@
 #include <ctime>
+#include <random>
+#include <omp.h>
 #include "RestSiteAlignUnit.h"
 
 int GetScore(int hCoord, int vCoord, const vector<vector<int>>& editGrid) {
@@ -16,7 +18,7 @@ void SetScore(int hCoord, int vCoord, int setVal, vector<vector<int>>& editGrid)
   }
 }
 
-int main( int argc, char** argv )
+int EditGridScore()
 {
   vector<int> read1  = {18,22,31,154,195,214,247,257,277,341,448,543,562,574,634,751,1749,1773,1783,1883};
   vector<int> read2  = {18,22,31,150,193,211,243,252,270,327,452,460,532,632,640,1707,1729,1759,1770,2040}; 
@@ -50,6 +52,221 @@ int main( int argc, char** argv )
       SetScore(hCoord, vCoord, currScore, editGrid);
     }
   }
-  cout<<maxCell_score<<endl;
+  return maxCell_score;
+}
+
+// Reference for DPMatcher: the floating point walk over the site distances it replaced, one site at a time
+int RefRSiteLenForBaseLength(const RSiteRead& read, int offset, bool dir, int totLength) {
+  if(dir) {
+    int count = offset+1;
+    while(count <= read.Size() && read.CumDist(count) < read.CumDist(offset) + totLength) { count++; }
+    return (count <= read.Size()? count-offset-1: read.Size()-offset);
+  } else {
+    int count = offset;
+    while(count >= 0 && read.CumDist(count) > read.CumDist(offset+1) - totLength) { count--; }
+    return offset-count;
+  }
+}
+
+MatchInfo RefWalk(const RSiteRead& read1, const RSiteRead& read2, int offset1, int offset2, bool matchDir, float indelVariance, float cndfCoef) {
+  int baseLength1 = (matchDir? read1.DistSum(offset1, read1.Size()): read1.DistSum(0, offset1+1));
+  int baseLength2 = (matchDir? read2.DistSum(offset2, read2.Size()): read2.DistSum(0, offset2+1));
+  int length1 = (matchDir? read1.Size() - offset1: offset1 + 1);
+  int length2 = (matchDir? read2.Size() - offset2: offset2 + 1);
+  if(baseLength1 <= baseLength2) { length2 = RefRSiteLenForBaseLength(read2, offset2, matchDir, baseLength1); }
+  else                           { length1 = RefRSiteLenForBaseLength(read1, offset1, matchDir, baseLength2); }
+
+  int maxCell_score = 0, maxCell_coord1 = offset1, maxCell_coord2 = offset2;
+  int coord1=0, coord2=0;
+  bool coord1Changed=true, coord2Changed=true;
+  int readCmt1=0, readCmt2=0;
+  while(coord1 < length1 && coord2 < length2) {
+    int readVal1 = (matchDir? read1[offset1+coord1]: read1[offset1-coord1]);
+    int readVal2 = (matchDir? read2[offset2+coord2]: read2[offset2-coord2]);
+    if(coord1Changed) { readCmt1 += readVal1; }
+    if(coord2Changed) { readCmt2 += readVal2; }
+    float average = (readCmt1 + readCmt2) / 2.0;
+    int deviation = sqrt(average*indelVariance)*cndfCoef;
+    if(readCmt1>=average-deviation && readCmt1<=average+deviation && readCmt2>=average-deviation && readCmt2<=average+deviation) { 
+      maxCell_score++;
+      maxCell_coord1 = (matchDir? offset1 + coord1: offset1 - coord1); 
+      maxCell_coord2 = (matchDir? offset2 + coord2: offset2 - coord2);
+      coord1++;
+      coord2++;
+      readCmt1 = readCmt2 = 0;
+      coord1Changed = coord2Changed = true;
+      continue;
+    }
+    coord1Changed = (readCmt1 <= readCmt2);
+    coord2Changed = !coord1Changed;
+    if(coord1Changed) { coord1++; } else { coord2++; }
+  }
+  if(matchDir) { return MatchInfo(maxCell_score, offset1, maxCell_coord1, offset2, maxCell_coord2, length1, length2); }
+  else         { return MatchInfo(maxCell_score, maxCell_coord1, offset1, maxCell_coord2, offset2, length1, length2); }
+}
+
+MatchInfo RefMatch(const Dmer& dm1, const RSiteRead& read1, const Dmer& dm2, const RSiteRead& read2, float indelVariance, float cndfCoef) {
+  MatchInfo mInfo1 = RefWalk(read1, read2, dm1.Pos(), dm2.Pos(), true, indelVariance, cndfCoef);
+  MatchInfo mInfo2 = RefWalk(read1, read2, dm1.Pos(), dm2.Pos(), false, indelVariance, cndfCoef);
+  return MatchInfo(mInfo1.GetNumMatches() + mInfo2.GetNumMatches() - 1, mInfo2.GetFirstMatchPos1(), mInfo1.GetLastMatchPos1(),
+                   mInfo2.GetFirstMatchPos2(), mInfo1.GetLastMatchPos2(), mInfo1.GetSeqLen1() + mInfo2.GetSeqLen1(), 
+                   mInfo1.GetSeqLen2() + mInfo2.GetSeqLen2());
+}
+
+bool SameMatch(const MatchInfo& m1, const MatchInfo& m2) {
+  return m1.GetNumMatches() == m2.GetNumMatches() && m1.GetFirstMatchPos1() == m2.GetFirstMatchPos1() 
+         && m1.GetLastMatchPos1() == m2.GetLastMatchPos1() && m1.GetFirstMatchPos2() == m2.GetFirstMatchPos2() 
+         && m1.GetLastMatchPos2() == m2.GetLastMatchPos2() && m1.GetSeqLen1() == m2.GetSeqLen1() && m1.GetSeqLen2() == m2.GetSeqLen2();
+}
+
+// Pairs of similar reads (gaps with noise, missing and extra sites) with both strands, gaps reaching beyond the tolerance table 
+// (sums of 2^15 and more) in some of them, plus reads of a single site and of equal sites
+void AddTestReads(RSiteReads& reads, std::mt19937& gen) {
+  for(int pairIdx=0; pairIdx<1000; pairIdx++) {
+    int scale = (pairIdx%25 == 0? 100000: (pairIdx%5 == 0? 5000: 256));
+    int numSites = (pairIdx%100 == 1? 1: 20 + gen()%200);
+    svec<int> sites1, sites2;
+    int pos1 = 0, pos2 = 0;
+    for(int i=0; i<numSites; i++) {
+      int gap = (pairIdx%100 == 2? 0: 1 + gen()%(2*scale));
+      pos1 += gap;
+      sites1.push_back(pos1);
+      if(gen()%20 == 0) { continue; } // Missing site
+      pos2 += max(0, gap + ((int)(gen()%21)-10)*gap/100);
+      sites2.push_back(pos2);
+      if(gen()%25 == 0) { sites2.push_back(pos2 += 1 + gen()%scale); } // Extra site
+    }
+    reads.AddSequence("a", sites1.data(), sites1.isize(), 5, 7);
+    reads.AddSequence("b", sites2.data(), sites2.isize(), 3, 9);
+  }
+}
+
+// DPMatcher has to take exactly the decisions of the floating point walk: the same match for every candidate it does not reject
+// early and the same verdict for every candidate
+bool TestDPMatcher() {
+  std::mt19937 gen(7);
+  RSiteReads reads;
+  reads.SetReverseComplements(true);
+  AddTestReads(reads, gen);
+  int64_t numChecked = 0, numFailed = 0;
+  float indelVariances[] = {0.1, 0.05, 0.3};
+  float cndfCoefs[]      = {1.0, 2.5, 0.7};
+  float minScores[]      = {-1, 0.2, 0.45, 0.8}; // A negative minimum score accepts everything, so every walk is complete
+  for(int paramIdx=0; paramIdx<3; paramIdx++) {
+    for(float minScore:minScores) {
+      DPMatcher matcher(indelVariances[paramIdx], cndfCoefs[paramIdx], minScore);
+      std::mt19937 candGen(paramIdx);
+      for(int candIdx=0; candIdx<20000; candIdx++) {
+        // Mostly reads of the same pair on any strand, some unrelated ones; dmers near the same offset, including both ends
+        int seqIdx = 2*(candGen()%(reads.NumSequences()/2));
+        Dmer dm1, dm2;
+        dm1.Seq() = 2*seqIdx + candGen()%2;
+        dm2.Seq() = (candGen()%4 == 0? candGen()%reads.NumReads(): 2*(seqIdx+1) + candGen()%2);
+        RSiteRead read1 = reads[dm1.Seq()], read2 = reads[dm2.Seq()];
+        if(read1.Size() < 1 || read2.Size() < 1) { continue; }
+        dm1.Pos() = (candIdx%10 == 0? 0: (candIdx%10 == 1? read1.Size()-1: candGen()%read1.Size()));
+        dm2.Pos() = min(read2.Size()-1, max(0, dm1.Pos() + (int)(candGen()%5) - 2));
+        MatchInfo reference = RefMatch(dm1, read1, dm2, read2, indelVariances[paramIdx], cndfCoefs[paramIdx]);
+        MatchInfo mInfo;
+        DPMatcher::Verdict verdict = matcher.Validate(dm1, read1, dm2, read2, mInfo);
+        bool passed = ((verdict == DPMatcher::Accepted) == (reference.GetIdentScore() > minScore)
+                       && (verdict == DPMatcher::RejectedEarly || SameMatch(mInfo, reference)));
+        if(!passed) {
+          if(numFailed < 10) { 
+            cout << "DPMatcher mismatch for reads " << dm1.Seq() << " " << dm2.Seq() << " at " << dm1.Pos() << " " << dm2.Pos() 
+                 << ": " << mInfo.ToString() << " instead of " << reference.ToString() << endl;
+          }
+          numFailed++;
+        }
+        numChecked++;
+      }
+    }
+  }
+  cout << "DPMatcher: " << numChecked-numFailed << " of " << numChecked << " candidates as the floating point walk" << endl;
+  return numFailed == 0;
 }
 
+// Every kernel the CPU supports has to give the scalar mask: random cells of every tail length up to a full block, 
+// values on and next to the bounds, with and without a read to exclude
+bool TestDmerScan() {
+  svec<pair<const char*, DmerScan::ScanFunc> > kernels;
+  kernels.push_back(make_pair("scalar", DmerScan::MatchScalar));
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  kernels.push_back(make_pair("SSE2", DmerScan::MatchSSE));
+  if(__builtin_cpu_supports("avx2"))    { kernels.push_back(make_pair("AVX2", DmerScan::MatchAVX2));       }
+  if(__builtin_cpu_supports("avx512f")) { kernels.push_back(make_pair("AVX-512", DmerScan::MatchAVX512)); }
+#endif
+  std::mt19937 gen(11);
+  int numCells = 20000;
+  svec<svec<int> > values(numCells), seqs(numCells), lower(numCells), upper(numCells);
+  svec<int> counts(numCells), strides(numCells), lengths(numCells), excludes(numCells);
+  for(int cellIdx=0; cellIdx<numCells; cellIdx++) {
+    int count  = 1 + cellIdx%DmerScan::BlockSize;
+    int stride = (gen()%2 == 0? count: DmerScan::BlockSize + gen()%8);
+    int length = 1 + gen()%Dmer::MaxLength;
+    lower[cellIdx].resize(length);
+    upper[cellIdx].resize(length);
+    for(int d=0; d<length; d++) {
+      lower[cellIdx][d] = gen()%1000;
+      upper[cellIdx][d] = lower[cellIdx][d] + gen()%50;
+    }
+    values[cellIdx].resize(length*stride);
+    seqs[cellIdx].resize(count);
+    for(int k=0; k<count; k++) {
+      seqs[cellIdx][k] = gen()%8;
+      bool inside = (gen()%4 != 0); // Mostly candidates that can match, so every dimension gets tested
+      for(int d=0; d<length; d++) {
+        int span = upper[cellIdx][d] - lower[cellIdx][d];
+        int value = lower[cellIdx][d] + (inside? gen()%(span+1): (int)(gen()%(span+3)) - 1);
+        if(gen()%8 == 0) { value = (gen()%2 == 0? lower[cellIdx][d]: upper[cellIdx][d]) + (int)(gen()%3) - 1; }
+        values[cellIdx][d*stride+k] = value;
+      }
+    }
+    counts[cellIdx]   = count;
+    strides[cellIdx]  = stride;
+    lengths[cellIdx]  = length;
+    excludes[cellIdx] = (gen()%2 == 0? -1: (int)(gen()%8));
+  }
+
+  bool passed = true;
+  svec<uint32_t> expected(numCells);
+  for(int kernelIdx=0; kernelIdx<kernels.isize(); kernelIdx++) {
+    DmerScan::ScanFunc scan = kernels[kernelIdx].second;
+    int numFailed = 0;
+    for(int cellIdx=0; cellIdx<numCells; cellIdx++) {
+      uint32_t mask = scan(lower[cellIdx].data(), upper[cellIdx].data(), lengths[cellIdx], values[cellIdx].data(), strides[cellIdx],
+                           seqs[cellIdx].data(), counts[cellIdx], excludes[cellIdx]);
+      if(kernelIdx == 0) { expected[cellIdx] = mask; }
+      if(mask != expected[cellIdx]) {
+        if(numFailed < 10) {
+          cout << "DmerScan " << kernels[kernelIdx].first << " mask " << mask << " instead of " << expected[cellIdx] << " for " 
+               << counts[cellIdx] << " candidates of length " << lengths[cellIdx] << endl;
+        }
+        numFailed++;
+      }
+    }
+    uint32_t checksum = 0;
+    int numRepeats = 200;
+    double scanStart = omp_get_wtime();
+    for(int repeat=0; repeat<numRepeats; repeat++) {
+      for(int cellIdx=0; cellIdx<numCells; cellIdx++) {
+        checksum += scan(lower[cellIdx].data(), upper[cellIdx].data(), lengths[cellIdx], values[cellIdx].data(), strides[cellIdx],
+                         seqs[cellIdx].data(), counts[cellIdx], excludes[cellIdx]);
+      }
+    }
+    double scanTime = omp_get_wtime() - scanStart;
+    cout << "DmerScan " << kernels[kernelIdx].first << ": " << numCells-numFailed << " of " << numCells << " cells as the scalar kernel, " 
+         << scanTime/((double)numRepeats*numCells)*1e9 << " ns per cell (checksum " << checksum << ")" << endl;
+    passed &= (numFailed == 0);
+  }
+  return passed;
+}
+
+int main( int argc, char** argv )
+{
+  cout << EditGridScore() << endl;
+  bool passed = TestDPMatcher();
+  passed &= TestDmerScan();
+  return (passed? 0: 1);
+}